@@ -5,6 +5,11 @@
 #include <cstddef>
 #include <optional>
 #include <limits>
+#include <algorithm>
+#include <string_view>
+#include <memory>
+#include <future>
+#include <exception>
 
 #define JSON_DIAGNOSTICS 1
 #include <nlohmann/json.hpp>
@@ -12,13 +17,26 @@
 namespace vme::api
 {
 
+    // Reference to a string value, saving the copy get<std::string>() makes.
+    static const std::string& _string_ref(const nlohmann::json& item)
+    {
+        if (!item.is_string())
+        {
+            throw nlohmann::json::type_error::create(302,
+                std::format("type must be string, but is {}", item.type_name()),
+                &item);
+        }
+
+        return item.template get_ref<const std::string&>();
+    }
+
     static void _parse_audio_attachment(
         const nlohmann::json& item, vk_data::audio& out)
     {
         out.id = item.at("id").template get<std::int64_t>();
         out.owner_id = item.at("owner_id").template get<std::int64_t>();
-        out.artist = item.at("artist").template get<std::string>();
-        out.title = item.at("title").template get<std::string>();
+        out.artist = _string_ref(item.at("artist"));
+        out.title = _string_ref(item.at("title"));
         out.duration = item.at("duration").template get<std::int64_t>();
     }
 
@@ -27,13 +45,12 @@ namespace vme::api
     {
         out.id = item.at("id").template get<std::int64_t>();
         out.rate = item.at("rate").template get<float>();
-        out.text = item.at("text").template get<std::string>();
+        out.text = _string_ref(item.at("text"));
         out.votes = item.at("votes").template get<std::int64_t>();
     }
 
     static std::optional<vk_data::attachment> _parse_attachment(
-        const nlohmann::json& attachment_item, std::int64_t& link_id_counter,
-        std::int64_t& call_id_counter)
+        const nlohmann::json& attachment_item, vk_data::allocator alloc)
     {
         vk_data::attachment result;
 
@@ -46,24 +63,21 @@ namespace vme::api
             return std::nullopt;
         }
 
-        result.type = type.value();
         const nlohmann::json& attachment = attachment_item.at(type_str);
 
         switch (type.value())
         {
             using enum vk_data::attachment_type;
         case photo:
-            result.photo_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.photo_value.owner_id =
+        {
+            auto& value = result.value.emplace<vk_data::photo>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.owner_id =
                 attachment.at("owner_id").template get<std::int64_t>();
-            result.photo_value.date =
-                attachment.at("date").template get<std::int64_t>();
+            value.date = attachment.at("date").template get<std::int64_t>();
             if (attachment.contains("orig_photo"))
             {
-                result.photo_value.url = attachment.at("orig_photo")
-                                             .at("url")
-                                             .template get<std::string>();
+                value.url = _string_ref(attachment.at("orig_photo").at("url"));
             }
             else if (attachment.contains("width") &&
                      attachment.contains("height") &&
@@ -82,346 +96,326 @@ namespace vme::api
                     if (size > max_size)
                     {
                         max_size = size;
-                        result.photo_value.url =
-                            item.at("url").template get<std::string>();
+                        value.url = _string_ref(item.at("url"));
                     }
                 }
             }
             else
             {
                 auto& sizes = attachment.at("sizes");
-                result.photo_value.url = sizes.at(sizes.size() - 1)
-                                             .at("url")
-                                             .template get<std::string>();
+                value.url = _string_ref(sizes.at(sizes.size() - 1).at("url"));
             }
             break;
+        }
 
         case video:
         {
-            result.video_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.video_value.owner_id =
+            auto& value = result.value.emplace<vk_data::video>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.owner_id =
                 attachment.at("owner_id").template get<std::int64_t>();
-            result.video_value.date =
-                attachment.at("date").template get<std::int64_t>();
-            result.video_value.title =
-                attachment.at("title").template get<std::string>();
+            value.date = attachment.at("date").template get<std::int64_t>();
+            value.title = _string_ref(attachment.at("title"));
             if (attachment.contains("description"))
             {
-                result.video_value.description =
-                    attachment.at("description").template get<std::string>();
+                value.description.emplace(
+                    _string_ref(attachment.at("description")), alloc);
             }
             else
             {
-                result.video_value.description = std::nullopt;
+                value.description = std::nullopt;
             }
             if (attachment.contains("image"))
             {
                 const nlohmann::json& images_array = attachment.at("image");
                 const nlohmann::json& url_object =
                     images_array.at(images_array.size() - 1).at("url");
-                result.video_value.image_url =
-                    url_object.template get<std::string>();
+                value.image_url.emplace(_string_ref(url_object), alloc);
             }
             else
             {
-                result.video_value.image_url = std::nullopt;
+                value.image_url = std::nullopt;
             }
             break;
         }
 
         case audio:
-            _parse_audio_attachment(attachment, result.audio_value);
+        {
+            _parse_audio_attachment(
+                attachment, result.value.emplace<vk_data::audio>(alloc));
             break;
+        }
 
         case document:
-            result.document_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.document_value.owner_id =
+        {
+            auto& value = result.value.emplace<vk_data::document>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.owner_id =
                 attachment.at("owner_id").template get<std::int64_t>();
-            result.document_value.date =
-                attachment.at("date").template get<std::int64_t>();
-            result.document_value.title =
-                attachment.at("title").template get<std::string>();
-            result.document_value.ext =
-                attachment.at("ext").template get<std::string>();
-            result.document_value.url =
-                attachment.at("url").template get<std::string>();
+            value.date = attachment.at("date").template get<std::int64_t>();
+            value.title = _string_ref(attachment.at("title"));
+            value.ext = _string_ref(attachment.at("ext"));
+            value.url = _string_ref(attachment.at("url"));
             break;
+        }
 
         case link:
-            result.link_value.id = link_id_counter++;
-            result.link_value.url =
-                attachment.at("url").template get<std::string>();
-            result.link_value.title =
-                attachment.at("title").template get<std::string>();
+        {
+            auto& value = result.value.emplace<vk_data::link>(alloc);
+            value.id = 0;
+            value.url = _string_ref(attachment.at("url"));
+            value.title = _string_ref(attachment.at("title"));
             if (attachment.contains("caption"))
             {
-                result.link_value.caption =
-                    attachment.at("caption").template get<std::string>();
+                value.caption.emplace(
+                    _string_ref(attachment.at("caption")), alloc);
             }
             if (attachment.contains("description"))
             {
-                result.link_value.description =
-                    attachment.at("description").template get<std::string>();
+                value.description.emplace(
+                    _string_ref(attachment.at("description")), alloc);
             }
             else
             {
-                result.link_value.description = std::nullopt;
+                value.description = std::nullopt;
             }
             break;
+        }
 
         case product:
-            result.product_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.product_value.owner_id =
+        {
+            auto& value = result.value.emplace<vk_data::product>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.owner_id =
                 attachment.at("owner_id").template get<std::int64_t>();
-            result.product_value.title =
-                attachment.at("title").template get<std::string>();
-            result.product_value.description =
-                attachment.at("description").template get<std::string>();
-            result.product_value.price =
-                attachment.at("price").at("amount").template get<std::string>();
+            value.title = _string_ref(attachment.at("title"));
+            value.description = _string_ref(attachment.at("description"));
+            value.price = _string_ref(attachment.at("price").at("amount"));
             if (attachment.at("price").at("currency").is_object())
             {
-                result.product_value.currency =
-                    attachment.at("price")
-                        .at("currency")
-                        .at("name")
-                        .template get<std::string>();
+                value.currency = _string_ref(
+                    attachment.at("price").at("currency").at("name"));
             }
             else
             {
-                result.product_value.currency =
-                    attachment.at("price")
-                        .at("currency")
-                        .template get<std::string>();
+                value.currency =
+                    _string_ref(attachment.at("price").at("currency"));
             }
-            result.product_value.thumb_url =
-                attachment.at("thumb_photo").template get<std::string>();
+            value.thumb_url = _string_ref(attachment.at("thumb_photo"));
             break;
+        }
 
         case product_album:
-            result.product_album_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.product_album_value.owner_id =
+        {
+            auto& value = result.value.emplace<vk_data::product_album>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.owner_id =
                 attachment.at("owner_id").template get<std::int64_t>();
-            result.product_album_value.title =
-                attachment.at("title").template get<std::string>();
-            result.product_album_value.is_main =
-                attachment.at("is_main").template get<bool>();
-            result.product_album_value.is_hidden =
-                attachment.at("is_hidden").template get<bool>();
+            value.title = _string_ref(attachment.at("title"));
+            value.is_main = attachment.at("is_main").template get<bool>();
+            value.is_hidden = attachment.at("is_hidden").template get<bool>();
             break;
+        }
 
         case post:
-            result.post_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.post_value.owner_id =
+        {
+            auto& value = result.value.emplace<vk_data::post>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.owner_id =
                 attachment.at("owner_id").template get<std::int64_t>();
-            result.post_value.from_id =
+            value.from_id =
                 attachment.at("from_id").template get<std::int64_t>();
-            result.post_value.date =
-                attachment.at("date").template get<std::int64_t>();
-            result.post_value.text =
-                attachment.at("text").template get<std::string>();
+            value.date = attachment.at("date").template get<std::int64_t>();
+            value.text = _string_ref(attachment.at("text"));
             break;
+        }
 
         case comment:
-            result.comment_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.comment_value.from_id =
+        {
+            auto& value = result.value.emplace<vk_data::comment>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.from_id =
                 attachment.at("from_id").template get<std::int64_t>();
-            result.comment_value.date =
-                attachment.at("date").template get<std::int64_t>();
-            result.comment_value.text =
-                attachment.at("text").template get<std::string>();
+            value.date = attachment.at("date").template get<std::int64_t>();
+            value.text = _string_ref(attachment.at("text"));
             break;
+        }
 
         case sticker:
-            result.sticker_value.id =
-                attachment.at("sticker_id").template get<std::int64_t>();
-            result.sticker_value.url = std::format(
-                "https://vk.com/sticker/{}/512.png", result.sticker_value.id);
+        {
+            auto& value = result.value.emplace<vk_data::sticker>(alloc);
+            value.id = attachment.at("sticker_id").template get<std::int64_t>();
+            value.url =
+                std::format("https://vk.com/sticker/{}/512.png", value.id);
             break;
+        }
 
         case gift:
-            result.gift_value.id =
-                attachment.at("id").template get<std::int64_t>();
+        {
+            auto& value = result.value.emplace<vk_data::gift>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
             if (attachment.contains("thumb_512"))
             {
-                result.gift_value.url =
-                    attachment.at("thumb_512").template get<std::string>();
+                value.url = _string_ref(attachment.at("thumb_512"));
             }
             else if (attachment.contains("thumb_256"))
             {
-                result.gift_value.url =
-                    attachment.at("thumb_256").template get<std::string>();
+                value.url = _string_ref(attachment.at("thumb_256"));
             }
             else if (attachment.contains("thumb_96"))
             {
-                result.gift_value.url =
-                    attachment.at("thumb_96").template get<std::string>();
+                value.url = _string_ref(attachment.at("thumb_96"));
             }
             else
             {
-                result.gift_value.url =
-                    attachment.at("thumb_48").template get<std::string>();
+                value.url = _string_ref(attachment.at("thumb_48"));
             }
             break;
+        }
 
         case call:
-            result.call_value.id = call_id_counter++;
-            result.call_value.initiator_id =
+        {
+            auto& value = result.value.emplace<vk_data::call>(alloc);
+            value.id = 0;
+            value.initiator_id =
                 attachment.at("initiator_id").template get<std::int64_t>();
-            result.call_value.receiver_id =
+            value.receiver_id =
                 attachment.at("receiver_id").template get<std::int64_t>();
-            result.call_value.state =
-                attachment.at("state").template get<std::string>();
-            result.call_value.time =
-                attachment.at("time").template get<std::int64_t>();
-            result.call_value.duration =
+            value.state = _string_ref(attachment.at("state"));
+            value.time = attachment.at("time").template get<std::int64_t>();
+            value.duration =
                 attachment.at("duration").template get<std::int64_t>();
-            result.call_value.video =
-                attachment.at("video").template get<bool>();
+            value.video = attachment.at("video").template get<bool>();
             break;
+        }
 
         case audio_message:
-            result.audio_message_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.audio_message_value.owner_id =
+        {
+            auto& value = result.value.emplace<vk_data::audio_message>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.owner_id =
                 attachment.at("owner_id").template get<std::int64_t>();
-            result.audio_message_value.duration =
+            value.duration =
                 attachment.at("duration").template get<std::int64_t>();
-            result.audio_message_value.waveform.reserve(
-                attachment.at("waveform").size());
+            value.waveform.reserve(attachment.at("waveform").size());
             for (const auto& sample_item : attachment.at("waveform"))
             {
-                result.audio_message_value.waveform.push_back(
+                value.waveform.push_back(
                     sample_item.template get<std::uint16_t>());
             }
-            result.audio_message_value.link_mp3 =
-                attachment.at("link_mp3").template get<std::string>();
+            value.link_mp3 = _string_ref(attachment.at("link_mp3"));
             break;
+        }
 
         case audio_playlist:
-            result.audio_playlist_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.audio_playlist_value.owner_id =
+        {
+            auto& value = result.value.emplace<vk_data::audio_playlist>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.owner_id =
                 attachment.at("owner_id").template get<std::int64_t>();
-            result.audio_playlist_value.create_time =
+            value.create_time =
                 attachment.at("create_time").template get<std::int64_t>();
-            result.audio_playlist_value.update_time =
+            value.update_time =
                 attachment.at("update_time").template get<std::int64_t>();
             if (attachment.contains("year"))
             {
-                result.audio_playlist_value.year =
-                    attachment.at("year").template get<std::int64_t>();
+                value.year = attachment.at("year").template get<std::int64_t>();
             }
             else
             {
-                result.audio_playlist_value.year = std::nullopt;
+                value.year = std::nullopt;
             }
-            result.audio_playlist_value.title =
-                attachment.at("title").template get<std::string>();
-            result.audio_playlist_value.description =
-                attachment.at("description").template get<std::string>();
-            result.audio_playlist_value.audios.reserve(
-                attachment.at("audios").size());
+            value.title = _string_ref(attachment.at("title"));
+            value.description = _string_ref(attachment.at("description"));
+            value.audios.reserve(attachment.at("audios").size());
             for (const auto& audio_item : attachment.at("audios"))
             {
-                vk_data::audio parsed_audio;
+                vk_data::audio parsed_audio(alloc);
                 _parse_audio_attachment(audio_item, parsed_audio);
-                result.audio_playlist_value.audios.push_back(parsed_audio);
+                value.audios.push_back(std::move(parsed_audio));
             }
             break;
+        }
 
         case graffiti:
-            result.graffiti_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.graffiti_value.owner_id =
+        {
+            auto& value = result.value.emplace<vk_data::graffiti>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.owner_id =
                 attachment.at("owner_id").template get<std::int64_t>();
-            result.graffiti_value.url =
-                attachment.at("url").template get<std::string>();
+            value.url = _string_ref(attachment.at("url"));
             break;
+        }
 
         case money_request:
-            result.money_request_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.money_request_value.from_id =
+        {
+            auto& value = result.value.emplace<vk_data::money_request>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.from_id =
                 attachment.at("from_id").template get<std::int64_t>();
-            result.money_request_value.to_id =
-                attachment.at("to_id").template get<std::int64_t>();
-            result.money_request_value.amount =
-                attachment.at("amount")
-                    .at("amount")
-                    .template get<std::string>();
+            value.to_id = attachment.at("to_id").template get<std::int64_t>();
+            value.amount = _string_ref(attachment.at("amount").at("amount"));
             if (attachment.at("amount").at("currency").is_object())
             {
-                result.money_request_value.currency =
-                    attachment.at("amount")
-                        .at("currency")
-                        .at("name")
-                        .template get<std::string>();
+                value.currency = _string_ref(
+                    attachment.at("amount").at("currency").at("name"));
             }
             else
             {
-                result.money_request_value.currency =
-                    attachment.at("amount")
-                        .at("currency")
-                        .template get<std::string>();
+                value.currency =
+                    _string_ref(attachment.at("amount").at("currency"));
             }
             break;
+        }
 
         case story:
-            result.story_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.story_value.owner_id =
+        {
+            auto& value = result.value.emplace<vk_data::story>();
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.owner_id =
                 attachment.at("owner_id").template get<std::int64_t>();
-            result.story_value.date =
-                attachment.at("date").template get<std::int64_t>();
-            result.story_value.expires_at =
+            value.date = attachment.at("date").template get<std::int64_t>();
+            value.expires_at =
                 attachment.at("expires_at").template get<std::int64_t>();
             break;
+        }
 
         case poll:
-            result.poll_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.poll_value.owner_id =
+        {
+            auto& value = result.value.emplace<vk_data::poll>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.owner_id =
                 attachment.at("owner_id").template get<std::int64_t>();
-            result.poll_value.question =
-                attachment.at("question").template get<std::string>();
-            result.poll_value.votes =
-                attachment.at("votes").template get<std::int64_t>();
+            value.question = _string_ref(attachment.at("question"));
+            value.votes = attachment.at("votes").template get<std::int64_t>();
             for (const auto& item : attachment.at("answers"))
             {
-                vk_data::poll_answer poll_answer;
+                vk_data::poll_answer poll_answer(alloc);
                 _parse_poll_answer(item, poll_answer);
-                result.poll_value.answers.push_back(poll_answer);
+                value.answers.push_back(std::move(poll_answer));
             }
             break;
+        }
 
         case event:
-            result.event_value.id =
-                attachment.at("id").template get<std::int64_t>();
-            result.event_value.button_text =
-                attachment.at("button_text").template get<std::string>();
-            result.event_value.text =
-                attachment.at("text").template get<std::string>();
-            result.event_value.member_status =
+        {
+            auto& value = result.value.emplace<vk_data::event>(alloc);
+            value.id = attachment.at("id").template get<std::int64_t>();
+            value.button_text = _string_ref(attachment.at("button_text"));
+            value.text = _string_ref(attachment.at("text"));
+            value.member_status =
                 attachment.at("member_status").template get<std::int64_t>();
             break;
         }
+        }
 
         return result;
     }
 
-    static vk_data::message _parse_message(const nlohmann::json& message_item,
-        std::int64_t& link_id_counter, std::int64_t& call_id_counter)
+    static vk_data::message _parse_message(
+        const nlohmann::json& message_item, vk_data::allocator alloc)
     {
-        vk_data::message result;
-
-        result.original_json = message_item.dump();
+        vk_data::message result(alloc);
 
         if (message_item.contains("id"))
         {
@@ -451,7 +445,7 @@ namespace vme::api
             result.important = false;
         }
 
-        result.text = message_item.at("text").template get<std::string>();
+        result.text = _string_ref(message_item.at("text"));
 
         if (message_item.contains("reply_conversation_message_id"))
         {
@@ -478,10 +472,8 @@ namespace vme::api
             for (const nlohmann::json& fwd_message_item :
                 message_item.at("fwd_messages"))
             {
-                vk_data::message fwd_message = _parse_message(
-                    fwd_message_item, link_id_counter, call_id_counter);
                 result.fwd_messages.push_back(
-                    std::make_shared<vk_data::message>(fwd_message));
+                    _parse_message(fwd_message_item, alloc));
             }
         }
 
@@ -492,12 +484,11 @@ namespace vme::api
             for (const nlohmann::json& attachment_item :
                 message_item.at("attachments"))
             {
-                auto attachment = _parse_attachment(
-                    attachment_item, link_id_counter, call_id_counter);
+                auto attachment = _parse_attachment(attachment_item, alloc);
 
                 if (attachment.has_value())
                 {
-                    result.attachments.push_back(attachment.value());
+                    result.attachments.push_back(std::move(attachment.value()));
                 }
             }
         }
@@ -505,41 +496,374 @@ namespace vme::api
         return result;
     }
 
-    static std::vector<vk_data::message> _parse_messages(
-        const std::string& response, std::size_t& count,
-        std::int64_t& link_id_counter, std::int64_t& call_id_counter)
+    // The raw response is scanned only after the DOM parser has accepted
+    // it, so these helpers just track strings and nesting.
+    static bool _is_whitespace(char c) noexcept
     {
-        try
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    static std::size_t _skip_whitespace(
+        std::string_view json, std::size_t pos) noexcept
+    {
+        while (pos < json.size() && _is_whitespace(json[pos]))
+        {
+            pos++;
+        }
+
+        return pos;
+    }
+
+    static std::size_t _skip_string(
+        std::string_view json, std::size_t pos) noexcept
+    {
+        for (pos++; pos < json.size() && json[pos] != '"'; pos++)
+        {
+            if (json[pos] == '\\')
+            {
+                pos++;
+            }
+        }
+
+        return pos + 1;
+    }
+
+    static std::size_t _skip_value(
+        std::string_view json, std::size_t pos) noexcept
+    {
+        if (json[pos] == '"')
         {
-            nlohmann::json response_json = nlohmann::json::parse(response);
+            return _skip_string(json, pos);
+        }
 
-            if (response_json.contains("error"))
+        if (json[pos] != '{' && json[pos] != '[')
+        {
+            while (pos < json.size() && json[pos] != ',' && json[pos] != '}' &&
+                   json[pos] != ']' && !_is_whitespace(json[pos]))
             {
-                nlohmann::json& error_object = response_json.at("error");
+                pos++;
+            }
 
-                nlohmann::json& error_code_obj = error_object.at("error_code");
-                nlohmann::json& error_msg_obj = error_object.at("error_msg");
+            return pos;
+        }
 
-                throw message_stream_response_error(
-                    std::format("API returned an error: {} {}",
-                        error_code_obj.template get<int>(),
-                        error_msg_obj.template get<std::string>()));
+        std::size_t depth = 0;
+        while (pos < json.size())
+        {
+            char c = json[pos];
+            if (c == '"')
+            {
+                pos = _skip_string(json, pos);
+                continue;
+            }
+
+            pos++;
+            if (c == '{' || c == '[')
+            {
+                depth++;
+            }
+            else if ((c == '}' || c == ']') && --depth == 0)
+            {
+                break;
+            }
+        }
+
+        return pos;
+    }
+
+    // Calls f(key, value) for every member of an object, or f("", value)
+    // for every element of an array.
+    template<class Func>
+    static void _for_each_raw(std::string_view json, Func f)
+    {
+        bool is_object = json[0] == '{';
+        std::size_t pos = _skip_whitespace(json, 1);
+        while (pos < json.size() && json[pos] != '}' && json[pos] != ']')
+        {
+            std::string_view key;
+            if (is_object)
+            {
+                std::size_t key_end = _skip_string(json, pos);
+                key = json.substr(pos + 1, key_end - pos - 2);
+                pos = _skip_whitespace(json, key_end) + 1;
+                pos = _skip_whitespace(json, pos);
+            }
+
+            std::size_t end = _skip_value(json, pos);
+            f(key, json.substr(pos, end - pos));
+
+            pos = _skip_whitespace(json, end);
+            if (pos < json.size() && json[pos] == ',')
+            {
+                pos = _skip_whitespace(json, pos + 1);
+            }
+        }
+    }
+
+    static std::string_view _raw_member(
+        std::string_view json, std::string_view name)
+    {
+        std::string_view result;
+        _for_each_raw(json,
+            [&](std::string_view key, std::string_view value)
+            {
+                if (key == name)
+                {
+                    result = value;
+                }
+            });
+
+        return result;
+    }
+
+    // Points original_json of a parsed message and its forwarded messages
+    // at their text in the response instead of serialising them again.
+    static void _bind_original_json(vk_data::message& message,
+        std::string_view raw, const std::shared_ptr<vk_data::page>& source)
+    {
+        message.source = source;
+        message.original_json = raw;
+
+        if (message.fwd_messages.empty())
+        {
+            return;
+        }
+
+        std::size_t i = 0;
+        _for_each_raw(_raw_member(raw, "fwd_messages"),
+            [&](std::string_view, std::string_view value)
+            {
+                _bind_original_json(message.fwd_messages.at(i++), value,
+                    source);
+            });
+    }
+
+    static void _check_response_error(const nlohmann::json& response_json)
+    {
+        if (response_json.contains("error"))
+        {
+            const nlohmann::json& error_object = response_json.at("error");
+
+            const nlohmann::json& error_code_obj =
+                error_object.at("error_code");
+            const nlohmann::json& error_msg_obj = error_object.at("error_msg");
+
+            throw message_stream_response_error(
+                std::format("API returned an error: {} {}",
+                    error_code_obj.template get<int>(),
+                    error_msg_obj.template get<std::string>()));
+        }
+    }
+
+    static void _check_history(
+        const nlohmann::json& history, std::size_t& count)
+    {
+        const nlohmann::json& count_obj = history.at("count");
+        count = count_obj.template get<std::size_t>();
+
+        if (!history.at("items").is_array())
+        {
+            throw message_stream_response_error(
+                "Invalid API response: items is not an array");
+        }
+    }
+
+    static void _bind_history(std::string_view history,
+        std::vector<vk_data::message>& messages, std::size_t& i,
+        const std::shared_ptr<vk_data::page>& source)
+    {
+        _for_each_raw(_raw_member(history, "items"),
+            [&](std::string_view, std::string_view value)
+            { _bind_original_json(messages.at(i++), value, source); });
+    }
+
+    // SAX handler building the response without its message items. Each
+    // item is collected on its own, turned into a message as soon as it is
+    // complete and dropped, so at most one message is held as a DOM. The
+    // remaining skeleton is validated the same way a full response was.
+    class history_sax_handler
+    {
+    public:
+        history_sax_handler(bool batched,
+            std::vector<vk_data::message>& messages,
+            vk_data::allocator alloc) :
+            m_batched(batched),
+            m_messages(messages),
+            m_alloc(alloc),
+            m_items(nullptr)
+        {
+        }
+
+        bool null() { return put(nullptr); }
+
+        bool boolean(bool value) { return put(value); }
+
+        bool number_integer(nlohmann::json::number_integer_t value)
+        {
+            return put(value);
+        }
+
+        bool number_unsigned(nlohmann::json::number_unsigned_t value)
+        {
+            return put(value);
+        }
+
+        bool number_float(nlohmann::json::number_float_t value,
+            const nlohmann::json::string_t&)
+        {
+            return put(value);
+        }
+
+        bool string(nlohmann::json::string_t& value)
+        {
+            return put(std::move(value));
+        }
+
+        bool binary(nlohmann::json::binary_t& value)
+        {
+            return put(std::move(value));
+        }
+
+        bool start_object(std::size_t)
+        {
+            m_stack.push_back(&place(nlohmann::json::object()));
+            return true;
+        }
+
+        bool key(nlohmann::json::string_t& value)
+        {
+            m_key = std::move(value);
+            return true;
+        }
+
+        bool end_object() { return end(); }
+
+        bool start_array(std::size_t)
+        {
+            bool is_items = m_key == "items" &&
+                            m_stack.size() == (m_batched ? 3 : 2) &&
+                            m_stack.back()->is_object();
+
+            m_stack.push_back(&place(nlohmann::json::array()));
+            if (is_items)
+            {
+                m_items = m_stack.back();
+            }
+
+            return true;
+        }
+
+        bool end_array() { return end(); }
+
+        template<class Exception>
+        bool parse_error(std::size_t, const std::string&, const Exception& e)
+        {
+            throw e;
+        }
+
+        nlohmann::json& skeleton() noexcept { return m_skeleton; }
+
+    private:
+        nlohmann::json& place(nlohmann::json&& value)
+        {
+            if (m_stack.empty())
+            {
+                m_skeleton = std::move(value);
+                return m_skeleton;
+            }
+
+            nlohmann::json& parent = *m_stack.back();
+            if (&parent == m_items)
+            {
+                m_item = std::move(value);
+                return m_item;
+            }
+
+            if (parent.is_object())
+            {
+                return parent[m_key] = std::move(value);
+            }
+
+            parent.push_back(std::move(value));
+            return parent.back();
+        }
+
+        bool put(nlohmann::json&& value)
+        {
+            place(std::move(value));
+            if (!m_stack.empty() && m_stack.back() == m_items)
+            {
+                m_messages.push_back(_parse_message(m_item, m_alloc));
             }
 
-            nlohmann::json response_body = response_json.at("response");
+            return true;
+        }
+
+        bool end()
+        {
+            m_stack.pop_back();
+            if (!m_stack.empty() && m_stack.back() == m_items)
+            {
+                m_messages.push_back(_parse_message(m_item, m_alloc));
+                m_item = nullptr;
+            }
 
-            nlohmann::json& count_obj = response_body.at("count");
-            count = count_obj.template get<std::size_t>();
+            return true;
+        }
 
-            nlohmann::json& items = response_body.at("items");
+        bool m_batched;
+        std::vector<vk_data::message>& m_messages;
+        vk_data::allocator m_alloc;
+        nlohmann::json m_skeleton;
+        nlohmann::json m_item;
+        nlohmann::json* m_items;
+        std::vector<nlohmann::json*> m_stack;
+        std::string m_key;
+    };
 
+    static std::vector<vk_data::message> _parse_response(
+        const std::string& response, bool batched, std::size_t& count,
+        vk_data::allocator alloc)
+    {
+        try
+        {
             std::vector<vk_data::message> result;
-            result.reserve(items.size());
 
-            for (const nlohmann::json& message_item : items)
+            history_sax_handler handler(batched, result, alloc);
+            nlohmann::json::sax_parse(response, &handler);
+
+            nlohmann::json& response_json = handler.skeleton();
+
+            _check_response_error(response_json);
+
+            nlohmann::json& response_body = response_json.at("response");
+
+            if (!batched)
             {
-                result.push_back(_parse_message(
-                    message_item, link_id_counter, call_id_counter));
+                _check_history(response_body, count);
+                return result;
+            }
+
+            for (const nlohmann::json& history : response_body)
+            {
+                if (history.is_boolean())
+                {
+                    std::string reason = "unknown error";
+                    if (response_json.contains("execute_errors"))
+                    {
+                        const nlohmann::json& error_object =
+                            response_json.at("execute_errors").at(0);
+                        reason = std::format("{} {}",
+                            error_object.at("error_code").template get<int>(),
+                            error_object.at("error_msg")
+                                .template get<std::string>());
+                    }
+
+                    throw message_stream_response_error(std::format(
+                        "API returned an error in batched call: {}", reason));
+                }
+
+                _check_history(history, count);
             }
 
             return result;
@@ -551,42 +875,336 @@ namespace vme::api
         }
     }
 
+    // Splits a successful response into the raw text of its items. Anything
+    // else is left to _parse_response, which reports it.
+    static bool _split_items(std::string_view response, bool batched,
+        std::vector<std::string_view>& items, std::size_t& count)
+    {
+        response.remove_prefix(_skip_whitespace(response, 0));
+        if (response[0] != '{' || !_raw_member(response, "error").empty())
+        {
+            return false;
+        }
+
+        std::string_view body = _raw_member(response, "response");
+        if (body.empty() || body[0] != (batched ? '[' : '{'))
+        {
+            return false;
+        }
+
+        std::vector<std::string_view> histories;
+        if (batched)
+        {
+            _for_each_raw(body,
+                [&](std::string_view, std::string_view history)
+                { histories.push_back(history); });
+        }
+        else
+        {
+            histories.push_back(body);
+        }
+
+        for (std::string_view history : histories)
+        {
+            if (history[0] != '{')
+            {
+                return false;
+            }
+
+            std::string_view count_raw = _raw_member(history, "count");
+            std::string_view items_raw = _raw_member(history, "items");
+            if (count_raw.empty() || items_raw.empty() || items_raw[0] != '[')
+            {
+                return false;
+            }
+
+            count =
+                nlohmann::json::parse(count_raw).template get<std::size_t>();
+            _for_each_raw(items_raw,
+                [&](std::string_view, std::string_view item)
+                { items.push_back(item); });
+        }
+
+        return true;
+    }
+
+    // Items are parsed in contiguous slices, one of them on the calling
+    // thread, and joined in slice order, so the order of the response is
+    // kept. Monotonic resources are not thread-safe, so each slice
+    // allocates from an arena of its own.
+    static std::vector<vk_data::message> _parse_items(
+        const std::vector<std::string_view>& items,
+        const std::shared_ptr<vk_data::page>& page, thread_pool& pool)
+    {
+        std::size_t slices = std::min(pool.size() + 1, items.size());
+        std::vector<std::vector<vk_data::message>> parsed(slices);
+        std::vector<vk_data::allocator> arenas;
+        for (std::size_t slice = 0; slice < slices; slice++)
+        {
+            arenas.emplace_back(&page->arenas.emplace_back(
+                page->response.size() / slices));
+        }
+
+        auto parse_slice = [&](std::size_t slice)
+        {
+            std::size_t end = (slice + 1) * items.size() / slices;
+            for (std::size_t i = slice * items.size() / slices; i < end; i++)
+            {
+                parsed[slice].push_back(_parse_message(
+                    nlohmann::json::parse(items[i]), arenas[slice]));
+                _bind_original_json(parsed[slice].back(), items[i], page);
+            }
+        };
+
+        std::vector<std::future<void>> futures;
+        for (std::size_t slice = 1; slice < slices; slice++)
+        {
+            futures.push_back(
+                pool.submit([&parse_slice, slice] { parse_slice(slice); }));
+        }
+
+        // Every slice has to finish before the result goes out of scope.
+        std::exception_ptr error;
+        try
+        {
+            if (slices != 0)
+            {
+                parse_slice(0);
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        for (auto& future : futures)
+        {
+            try
+            {
+                future.get();
+            }
+            catch (...)
+            {
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
+        }
+
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+
+        std::vector<vk_data::message> result;
+        result.reserve(items.size());
+        for (auto& slice : parsed)
+        {
+            std::move(slice.begin(), slice.end(), std::back_inserter(result));
+        }
+
+        return result;
+    }
+
+    static std::vector<vk_data::message> _parse_messages(
+        const std::shared_ptr<vk_data::page>& page, bool batched,
+        std::size_t& count, thread_pool* pool)
+    {
+        const std::string& response = page->response;
+
+        // The raw scanner relies on the response being valid JSON.
+        std::vector<std::string_view> items;
+        if (pool != nullptr && nlohmann::json::accept(response))
+        {
+            try
+            {
+                if (_split_items(response, batched, items, count))
+                {
+                    return _parse_items(items, page, *pool);
+                }
+            }
+            catch (const nlohmann::json::exception& e)
+            {
+                throw message_stream_response_error(
+                    std::format("Invalid API response: {}", e.what()));
+            }
+        }
+
+        // Parsed text takes less room than the JSON it came from.
+        std::vector<vk_data::message> result = _parse_response(response,
+            batched, count, &page->arenas.emplace_back(response.size()));
+
+        std::string_view body = _raw_member(response, "response");
+        std::size_t i = 0;
+        if (!batched)
+        {
+            _bind_history(body, result, i, page);
+            return result;
+        }
+
+        _for_each_raw(body,
+            [&](std::string_view, std::string_view history)
+            { _bind_history(history, result, i, page); });
+
+        return result;
+    }
+
+    // Link and call ids are local counters rather than VK ids. They are
+    // assigned in delivery order, so the result does not depend on which
+    // thread parsed a page.
+    static void _assign_ids(vk_data::message& message,
+        std::int64_t& link_id_counter, std::int64_t& call_id_counter)
+    {
+        for (auto& fwd_message : message.fwd_messages)
+        {
+            _assign_ids(fwd_message, link_id_counter, call_id_counter);
+        }
+
+        for (auto& attachment : message.attachments)
+        {
+            switch (attachment.type())
+            {
+                using enum vk_data::attachment_type;
+            case link:
+                std::get<vk_data::link>(attachment.value).id =
+                    link_id_counter++;
+                break;
+
+            case call:
+                std::get<vk_data::call>(attachment.value).id =
+                    call_id_counter++;
+                break;
+
+            default:
+                break;
+            }
+        }
+    }
+
+    static std::string _history_code(std::int64_t peer_id, std::size_t offset,
+        std::size_t page_size, std::size_t pages)
+    {
+        std::string code = "return [";
+        for (std::size_t i = 0; i < pages; i++)
+        {
+            if (i != 0)
+            {
+                code += ",";
+            }
+
+            code += std::format("API.messages.getHistory({{\"peer_id\":{},"
+                                "\"offset\":{},\"count\":{},\"rev\":1}})",
+                peer_id, offset + i * page_size, page_size);
+        }
+        code += "];";
+
+        return code;
+    }
+
     message_stream::message_stream(api::session& s, std::int64_t peer_id,
-        const std::string& access_token) noexcept :
+        const std::string& access_token, std::size_t batch_size,
+        std::size_t read_ahead, std::size_t parallel_fetch,
+        std::size_t parse_threads, std::size_t offset,
+        std::int64_t last_conversation_message_id, std::int64_t first_link_id,
+        std::int64_t first_call_id) :
         m_session(s),
         m_peer_id(peer_id),
         m_access_token(access_token),
-        m_current_offset(0),
+        m_batch_size(batch_size),
+        m_read_ahead(std::max(read_ahead, parallel_fetch)),
+        m_parallel_fetch(parallel_fetch),
+        m_parse_pool(parse_threads > 1
+                ? std::make_unique<thread_pool>(parse_threads - 1)
+                : nullptr),
+        m_current_offset(offset),
+        m_delivered_offset(offset),
+        m_last_conversation_message_id(last_conversation_message_id),
         m_message_count(0),
-        m_link_id_counter(0),
-        m_call_id_counter(0)
+        m_link_id_counter(first_link_id),
+        m_call_id_counter(first_call_id),
+        m_fetch_offset(offset),
+        m_fetch_limit(std::numeric_limits<std::size_t>::max()),
+        m_fetches_pending(0),
+        m_count_known(false),
+        m_prefetch_stopped(false)
     {
+        rewind();
+
+        if (read_ahead == 0 && parallel_fetch == 1)
+        {
+            m_read_ahead = 0;
+            return;
+        }
+
+        for (std::size_t i = 0; i < m_parallel_fetch; i++)
+        {
+            m_prefetch_threads.emplace_back(
+                &message_stream::prefetch_worker, this);
+        }
+    }
+
+    message_stream::~message_stream() noexcept
+    {
+        {
+            std::lock_guard lock(m_prefetch_mutex);
+            m_prefetch_stopped = true;
+        }
+
+        m_prefetch_cv.notify_all();
+
+        for (auto& thread : m_prefetch_threads)
+        {
+            thread.join();
+        }
     }
 
     std::optional<vk_data::message> message_stream::next()
     {
-        if (m_message_buffer.empty())
+        // A chunk may consist of skipped messages only.
+        while (m_message_buffer.empty())
         {
-            // clang-format off
-            std::string response =
-                m_session.call("method/messages.getHistory", {
-                    { "offset",       m_current_offset },
-                    { "peer_id",      m_peer_id },
-                    { "access_token", m_access_token },
-                    { "count",        200 },
-                    { "rev",          1 },
-                    { "v",            "5.199" }
-            });
-            // clang-format on
+            std::vector<vk_data::message> messages;
+
+            if (m_read_ahead == 0)
+            {
+                std::size_t pages =
+                    chunk_pages(m_current_offset, m_message_count);
+                messages = fetch(m_current_offset, pages);
+                m_current_offset += PAGE_SIZE * pages;
+            }
+            else
+            {
+                std::unique_lock lock(m_prefetch_mutex);
+                m_prefetch_cv.wait(lock,
+                    [this]
+                    {
+                        return m_prefetched.contains(m_current_offset) ||
+                               m_current_offset >= m_fetch_limit ||
+                               m_prefetch_error;
+                    });
 
-            std::vector<vk_data::message> messages = _parse_messages(response,
-                m_message_count, m_link_id_counter, m_call_id_counter);
-            m_current_offset += 200;
+                auto it = m_prefetched.find(m_current_offset);
+                if (it != m_prefetched.end())
+                {
+                    messages = std::move(it->second.messages);
+                    m_current_offset = it->second.next_offset;
+                    m_prefetched.erase(it);
+                    m_fetches_pending--;
+                    m_prefetch_cv.notify_all();
+                }
+                else if (m_current_offset < m_fetch_limit)
+                {
+                    std::rethrow_exception(m_prefetch_error);
+                }
+            }
 
-            for (const auto& message : messages)
+            if (messages.empty())
             {
-                m_message_buffer.push(std::move(message));
+                break;
             }
+
+            buffer(std::move(messages));
         }
 
         if (m_message_buffer.empty())
@@ -596,7 +1214,8 @@ namespace vme::api
 
         vk_data::message message = std::move(m_message_buffer.front());
         m_message_buffer.pop();
-        return std::make_optional(message);
+        m_delivered_offset++;
+        return std::make_optional(std::move(message));
     }
 
     std::size_t message_stream::message_count() const noexcept
@@ -604,4 +1223,206 @@ namespace vme::api
         return m_message_count;
     }
 
+    std::size_t message_stream::offset() const noexcept
+    {
+        return m_delivered_offset;
+    }
+
+    std::size_t message_stream::chunk_pages(
+        std::size_t offset, std::size_t message_count) const noexcept
+    {
+        // Until the first response arrives the total count is unknown,
+        // so only a single page is requested.
+        if (offset == 0 || message_count <= offset)
+        {
+            return 1;
+        }
+
+        std::size_t remaining = message_count - offset;
+        return std::min(m_batch_size,
+            std::max<std::size_t>(1, (remaining + PAGE_SIZE - 1) / PAGE_SIZE));
+    }
+
+    void message_stream::rewind()
+    {
+        // The page at the start offset has to reach back to the last stored
+        // message. If more than a page was deleted since the checkpoint, it
+        // does not, and newer messages below it would never be fetched.
+        std::size_t offset = m_current_offset;
+        std::vector<vk_data::message> messages;
+        while (offset > 0)
+        {
+            messages = fetch(offset, 1);
+            m_count_known = true;
+            if (!messages.empty() &&
+                messages.front().conversation_message_id <=
+                    m_last_conversation_message_id)
+            {
+                break;
+            }
+
+            messages.clear();
+
+            // An empty page lies past the end of a history that shrank.
+            std::size_t end = std::min<std::size_t>(offset, m_message_count);
+            offset = end - std::min(end, PAGE_SIZE);
+        }
+
+        m_current_offset = offset;
+        m_delivered_offset = offset;
+
+        // The page that overlaps is not fetched again.
+        if (!messages.empty())
+        {
+            m_current_offset += PAGE_SIZE;
+            buffer(std::move(messages));
+        }
+
+        m_fetch_offset = m_current_offset;
+    }
+
+    void message_stream::buffer(std::vector<vk_data::message>&& messages)
+    {
+        for (auto& message : messages)
+        {
+            // Messages stored by a previous run are dropped before they take
+            // link and call ids. The buffer is empty, so they precede
+            // everything in it.
+            if (message.conversation_message_id <=
+                m_last_conversation_message_id)
+            {
+                m_delivered_offset++;
+                continue;
+            }
+
+            _assign_ids(message, m_link_id_counter, m_call_id_counter);
+            m_message_buffer.push(std::move(message));
+        }
+    }
+
+    bool message_stream::claimable() const noexcept
+    {
+        // The chunk next() waits for is always claimed, even when the count
+        // has dropped below it, so the end of the history is found.
+        if (m_fetch_offset == m_current_offset)
+        {
+            return true;
+        }
+
+        // Past the known count a single page is claimed to confirm the end.
+        return m_count_known && m_fetch_offset < m_message_count + PAGE_SIZE;
+    }
+
+    std::vector<vk_data::message> message_stream::fetch(
+        std::size_t offset, std::size_t pages)
+    {
+        std::string response;
+        if (pages == 1)
+        {
+            // clang-format off
+            response =
+                m_session.call("method/messages.getHistory", {
+                    { "offset",       offset },
+                    { "peer_id",      m_peer_id },
+                    { "access_token", m_access_token },
+                    { "count",        PAGE_SIZE },
+                    { "rev",          1 },
+                    { "v",            "5.199" }
+            });
+            // clang-format on
+        }
+        else
+        {
+            // clang-format off
+            response =
+                m_session.call("method/execute", {
+                    { "code",         _history_code(m_peer_id, offset,
+                                          PAGE_SIZE, pages) },
+                    { "access_token", m_access_token },
+                    { "v",            "5.199" }
+            });
+            // clang-format on
+        }
+
+        auto page = std::make_shared<vk_data::page>();
+        page->response = std::move(response);
+
+        std::size_t message_count = 0;
+        std::vector<vk_data::message> messages = _parse_messages(
+            page, pages != 1, message_count, m_parse_pool.get());
+        m_message_count = message_count;
+
+        return messages;
+    }
+
+    void message_stream::prefetch_worker() noexcept
+    {
+        try
+        {
+            while (true)
+            {
+                std::size_t offset;
+                std::size_t pages;
+
+                {
+                    std::unique_lock lock(m_prefetch_mutex);
+                    m_prefetch_cv.wait(lock,
+                        [this]
+                        {
+                            return m_prefetch_stopped || m_prefetch_error ||
+                                   m_fetch_offset >= m_fetch_limit ||
+                                   (m_fetches_pending < m_read_ahead &&
+                                       claimable());
+                        });
+
+                    if (m_prefetch_stopped || m_prefetch_error ||
+                        m_fetch_offset >= m_fetch_limit)
+                    {
+                        return;
+                    }
+
+                    offset = m_fetch_offset;
+                    pages = chunk_pages(offset, m_message_count);
+                    m_fetch_offset += PAGE_SIZE * pages;
+                    m_fetches_pending++;
+                }
+
+                std::vector<vk_data::message> messages = fetch(offset, pages);
+
+                {
+                    std::lock_guard lock(m_prefetch_mutex);
+                    m_count_known = true;
+
+                    // An empty chunk marks the end of the history; chunks
+                    // claimed past it are dropped.
+                    if (messages.empty())
+                    {
+                        m_fetch_limit = std::min(m_fetch_limit, offset);
+                    }
+
+                    if (offset < m_fetch_limit)
+                    {
+                        m_prefetched.emplace(offset,
+                            chunk { offset + PAGE_SIZE * pages,
+                                std::move(messages) });
+                    }
+                }
+
+                m_prefetch_cv.notify_all();
+            }
+        }
+        catch (...)
+        {
+            {
+                std::lock_guard lock(m_prefetch_mutex);
+                if (!m_prefetch_error)
+                {
+                    m_prefetch_error = std::current_exception();
+                }
+            }
+
+            m_prefetch_cv.notify_all();
+        }
+    }
+
 }
@@ -5,8 +5,17 @@
 #include <string>
 #include <cstddef>
 #include <queue>
+#include <map>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <memory>
 
 #include "api/session.h"
+#include "thread_pool.h"
 #include "vk_data.h"
 #include "error.h"
 
@@ -25,22 +34,79 @@ namespace vme::api
     class message_stream
     {
     public:
+        static constexpr std::size_t PAGE_SIZE = 200;
+        static constexpr std::size_t MAX_BATCH_SIZE = 25;
+
         message_stream(api::session& s, std::int64_t peer_id,
-            const std::string& access_token) noexcept;
+            const std::string& access_token, std::size_t batch_size,
+            std::size_t read_ahead, std::size_t parallel_fetch,
+            std::size_t parse_threads, std::size_t offset,
+            std::int64_t last_conversation_message_id,
+            std::int64_t first_link_id, std::int64_t first_call_id);
+
+        message_stream(const message_stream& other) = delete;
+
+        message_stream& operator=(const message_stream& other) = delete;
+
+        ~message_stream() noexcept;
 
         std::optional<vk_data::message> next();
 
         std::size_t message_count() const noexcept;
 
+        // Offset of the next message to be returned by next().
+        std::size_t offset() const noexcept;
+
     private:
+        struct chunk
+        {
+            std::size_t next_offset;
+            std::vector<vk_data::message> messages;
+        };
+
+        std::size_t chunk_pages(
+            std::size_t offset, std::size_t message_count) const noexcept;
+
+        // Moves the start offset back until it overlaps the messages stored
+        // by a previous run, and buffers the page that does.
+        void rewind();
+
+        // Drops messages stored by a previous run and buffers the rest with
+        // their link and call ids. Called with an empty buffer only.
+        void buffer(std::vector<vk_data::message>&& messages);
+
+        bool claimable() const noexcept;
+
+        std::vector<vk_data::message> fetch(
+            std::size_t offset, std::size_t pages);
+
+        void prefetch_worker() noexcept;
+
         api::session& m_session;
         std::int64_t m_peer_id;
         std::string m_access_token;
+        std::size_t m_batch_size;
+        std::size_t m_read_ahead;
+        std::size_t m_parallel_fetch;
+        std::unique_ptr<thread_pool> m_parse_pool;
         std::size_t m_current_offset;
+        std::size_t m_delivered_offset;
+        std::int64_t m_last_conversation_message_id;
         std::queue<vk_data::message> m_message_buffer;
-        std::size_t m_message_count;
+        std::atomic<std::size_t> m_message_count;
         std::int64_t m_link_id_counter;
         std::int64_t m_call_id_counter;
+
+        std::mutex m_prefetch_mutex;
+        std::condition_variable m_prefetch_cv;
+        std::map<std::size_t, chunk> m_prefetched;
+        std::size_t m_fetch_offset;
+        std::size_t m_fetch_limit;
+        std::size_t m_fetches_pending;
+        bool m_count_known;
+        bool m_prefetch_stopped;
+        std::exception_ptr m_prefetch_error;
+        std::vector<std::thread> m_prefetch_threads;
     };
 
 }
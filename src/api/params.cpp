@@ -1,6 +1,5 @@
 #include "params.h"
 
-#include <sstream>
 #include <cstddef>
 #include <format>
 
@@ -20,6 +19,32 @@ namespace vme::api
             std::format("Index {} is out of bounds (size: {})", index, size));
     }
 
+    static std::string _url_encode(const std::string& value) noexcept
+    {
+        static const char hex[] = "0123456789ABCDEF";
+
+        std::string result;
+        result.reserve(value.length());
+
+        for (unsigned char c : value)
+        {
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' ||
+                c == '~')
+            {
+                result.push_back(c);
+            }
+            else
+            {
+                result.push_back('%');
+                result.push_back(hex[c >> 4]);
+                result.push_back(hex[c & 0xF]);
+            }
+        }
+
+        return result;
+    }
+
     std::string param::key() const noexcept { return m_key; }
 
     std::string param::value() const noexcept { return m_value; }
@@ -92,19 +117,21 @@ namespace vme::api
 
     std::string params::to_query() const noexcept
     {
-        std::stringstream query_stream;
+        std::string query;
 
         for (std::size_t i = 0; i < m_values.size(); i++)
         {
-            query_stream << m_values[i].key() << "=" << m_values[i].value();
+            query += m_values[i].key();
+            query += '=';
+            query += _url_encode(m_values[i].value());
 
             if (i != m_values.size() - 1)
             {
-                query_stream << "&";
+                query += '&';
             }
         }
 
-        return query_stream.str();
+        return query;
     }
 
 }
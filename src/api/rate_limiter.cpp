@@ -0,0 +1,84 @@
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace vme::api
+{
+
+    rate_limiter::rate_limiter(std::size_t requests_per_second) :
+        m_max_rate(static_cast<double>(requests_per_second)),
+        m_rate(static_cast<double>(requests_per_second)),
+        m_tokens(1.0),
+        m_last_refill(clock::now()),
+        m_paused_until(clock::now())
+    {
+    }
+
+    void rate_limiter::acquire()
+    {
+        std::unique_lock lock(m_mutex);
+
+        while (true)
+        {
+            clock::time_point now = clock::now();
+            clock::duration wait = clock::duration::zero();
+
+            if (now < m_paused_until)
+            {
+                wait = m_paused_until - now;
+            }
+            else
+            {
+                refill(now);
+                if (m_tokens >= 1.0)
+                {
+                    m_tokens -= 1.0;
+                    return;
+                }
+
+                wait = std::chrono::duration_cast<clock::duration>(
+                    std::chrono::duration<double>((1.0 - m_tokens) / m_rate));
+            }
+
+            lock.unlock();
+            std::this_thread::sleep_for(wait);
+            lock.lock();
+        }
+    }
+
+    void rate_limiter::throttle(std::chrono::milliseconds backoff) noexcept
+    {
+        std::lock_guard lock(m_mutex);
+
+        clock::time_point now = clock::now();
+        refill(now);
+
+        m_rate = std::max(m_rate / 2.0, m_max_rate / 8.0);
+        m_tokens = 0.0;
+        m_paused_until = std::max(m_paused_until, now + backoff);
+        m_last_refill = m_paused_until;
+    }
+
+    void rate_limiter::relax() noexcept
+    {
+        std::lock_guard lock(m_mutex);
+
+        m_rate = std::min(m_rate + m_max_rate / 10.0, m_max_rate);
+    }
+
+    void rate_limiter::refill(clock::time_point now) noexcept
+    {
+        if (now <= m_last_refill)
+        {
+            return;
+        }
+
+        std::chrono::duration<double> elapsed = now - m_last_refill;
+        // No bursts: a full second's worth of tokens could otherwise be
+        // spent right after another second's worth and trip the limit.
+        m_tokens = std::min(m_tokens + elapsed.count() * m_rate, 1.0);
+        m_last_refill = now;
+    }
+
+}
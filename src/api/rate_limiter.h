@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <chrono>
+#include <mutex>
+
+namespace vme::api
+{
+
+    class rate_limiter
+    {
+    public:
+        rate_limiter(std::size_t requests_per_second);
+
+        rate_limiter(const rate_limiter& other) = delete;
+
+        rate_limiter& operator=(const rate_limiter& other) = delete;
+
+        void acquire();
+
+        void throttle(std::chrono::milliseconds backoff) noexcept;
+
+        void relax() noexcept;
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        void refill(clock::time_point now) noexcept;
+
+        std::mutex m_mutex;
+        double m_max_rate;
+        double m_rate;
+        double m_tokens;
+        clock::time_point m_last_refill;
+        clock::time_point m_paused_until;
+    };
+
+}
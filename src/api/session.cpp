@@ -1,29 +1,113 @@
 #include "session.h"
 
 #include <cstdlib>
-#include <sstream>
+#include <chrono>
+#include <algorithm>
 
 #include <curl/curl.h>
 
+#define JSON_DIAGNOSTICS 1
+#include <nlohmann/json.hpp>
+
 namespace vme::api
 {
 
-    session::session(const std::string& host) :
-        m_host(host)
+    // VK reports exceeded request rate as error 6 ("Too many requests per
+    // second") and error 9 ("Flood control").
+    static bool _is_rate_limited(const std::string& response) noexcept
+    {
+        if (!response.starts_with("{\"error\""))
+        {
+            return false;
+        }
+
+        try
+        {
+            nlohmann::json response_json = nlohmann::json::parse(response);
+            int error_code = response_json.at("error")
+                                 .at("error_code")
+                                 .template get<int>();
+            return error_code == 6 || error_code == 9;
+        }
+        catch (const nlohmann::json::exception&)
+        {
+            return false;
+        }
+    }
+
+    session::session(const std::string& host, std::size_t requests_per_second) :
+        m_host(host),
+        m_rate_limiter(requests_per_second),
+        m_received_bytes(0),
+        m_response_bytes(0)
     {
     }
 
     std::string session::call(const std::string& method, params p)
     {
-        std::stringstream addr_stream;
-        addr_stream << "https://" << m_host << "/" << method << "?"
-                    << p.to_query();
+        std::string url = "https://" + m_host + "/" + method + "?" +
+                          p.to_query();
+
+        std::chrono::milliseconds backoff(1000);
+        for (std::size_t attempt = 0;; attempt++)
+        {
+            m_rate_limiter.acquire();
+
+            // A stalled request is sent again right away, it already waited
+            // out the stall.
+            std::string response;
+            try
+            {
+                response = perform(url);
+            }
+            catch (const curl_timeout_error&)
+            {
+                if (attempt == MAX_RETRIES)
+                {
+                    throw;
+                }
+
+                continue;
+            }
+
+            if (!_is_rate_limited(response))
+            {
+                m_rate_limiter.relax();
+                return response;
+            }
+
+            // The limiter keeps its pace, VK still refuses requests.
+            if (attempt == MAX_RETRIES)
+            {
+                return response;
+            }
+
+            m_rate_limiter.throttle(backoff);
+            backoff = std::min(backoff * 2, std::chrono::milliseconds(30000));
+        }
+    }
+
+    std::string session::perform(const std::string& url)
+    {
+        std::string response;
+
+        curl c;
+        c.perform(url, response);
 
-        std::stringstream data_stream;
+        m_received_bytes += c.received_bytes();
+        m_response_bytes += response.size();
 
-        m_curl.perform(addr_stream.str(), data_stream);
+        return response;
+    }
 
-        return data_stream.str();
+    std::size_t session::received_bytes() const noexcept
+    {
+        return m_received_bytes;
+    }
+
+    std::size_t session::response_bytes() const noexcept
+    {
+        return m_response_bytes;
     }
 
 }
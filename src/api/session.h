@@ -1,8 +1,11 @@
 #pragma once
 
 #include <string>
+#include <cstddef>
+#include <atomic>
 
 #include "params.h"
+#include "rate_limiter.h"
 #include "curl.h"
 
 namespace vme::api
@@ -11,13 +14,24 @@ namespace vme::api
     class session
     {
     public:
-        session(const std::string& host);
+        static constexpr std::size_t MAX_RETRIES = 5;
+
+        session(const std::string& host, std::size_t requests_per_second);
 
         std::string call(const std::string& method, params p);
 
+        // Response bytes as received and after decompression.
+        std::size_t received_bytes() const noexcept;
+
+        std::size_t response_bytes() const noexcept;
+
     private:
+        std::string perform(const std::string& url);
+
         std::string m_host;
-        curl m_curl;
+        rate_limiter m_rate_limiter;
+        std::atomic<std::size_t> m_received_bytes;
+        std::atomic<std::size_t> m_response_bytes;
     };
 
 }
@@ -6,6 +6,7 @@
 #include <sstream>
 #include <cstddef>
 #include <cstdint>
+#include <algorithm>
 
 #define JSON_DIAGNOSTICS 1
 #include <nlohmann/json.hpp>
@@ -69,70 +70,96 @@ namespace vme::api
 
         for (const auto& attachment : message.attachments)
         {
-            switch (attachment.type)
+            switch (attachment.type())
             {
                 using enum vk_data::attachment_type;
             case photo:
-                ids.insert(attachment.photo_value.owner_id);
+                ids.insert(std::get<vk_data::photo>(attachment.value).owner_id);
                 break;
 
             case video:
-                ids.insert(attachment.video_value.owner_id);
+                ids.insert(std::get<vk_data::video>(attachment.value).owner_id);
                 break;
 
             case audio:
-                ids.insert(attachment.audio_value.owner_id);
+                ids.insert(std::get<vk_data::audio>(attachment.value).owner_id);
                 break;
 
             case document:
-                ids.insert(attachment.document_value.owner_id);
+                ids.insert(
+                    std::get<vk_data::document>(attachment.value).owner_id);
                 break;
 
             case product:
-                ids.insert(attachment.product_value.owner_id);
+                ids.insert(
+                    std::get<vk_data::product>(attachment.value).owner_id);
                 break;
 
             case product_album:
-                ids.insert(attachment.product_album_value.owner_id);
+            {
+                const auto& value =
+                    std::get<vk_data::product_album>(attachment.value);
+                ids.insert(value.owner_id);
                 break;
+            }
 
             case post:
-                ids.insert(attachment.post_value.from_id);
-                ids.insert(attachment.post_value.owner_id);
+            {
+                const auto& value = std::get<vk_data::post>(attachment.value);
+                ids.insert(value.from_id);
+                ids.insert(value.owner_id);
                 break;
+            }
 
             case comment:
-                ids.insert(attachment.comment_value.from_id);
+                ids.insert(
+                    std::get<vk_data::comment>(attachment.value).from_id);
                 break;
 
             case call:
-                ids.insert(attachment.call_value.initiator_id);
-                ids.insert(attachment.call_value.receiver_id);
+            {
+                const auto& value = std::get<vk_data::call>(attachment.value);
+                ids.insert(value.initiator_id);
+                ids.insert(value.receiver_id);
                 break;
+            }
 
             case audio_message:
-                ids.insert(attachment.audio_message_value.owner_id);
+            {
+                const auto& value =
+                    std::get<vk_data::audio_message>(attachment.value);
+                ids.insert(value.owner_id);
                 break;
+            }
 
             case audio_playlist:
-                ids.insert(attachment.audio_playlist_value.owner_id);
-                for (const auto& audio : attachment.audio_playlist_value.audios)
+            {
+                const auto& value =
+                    std::get<vk_data::audio_playlist>(attachment.value);
+                ids.insert(value.owner_id);
+                for (const auto& audio : value.audios)
                 {
                     ids.insert(audio.owner_id);
                 }
                 break;
+            }
 
             case graffiti:
-                ids.insert(attachment.graffiti_value.owner_id);
+                ids.insert(
+                    std::get<vk_data::graffiti>(attachment.value).owner_id);
                 break;
 
             case money_request:
-                ids.insert(attachment.money_request_value.from_id);
-                ids.insert(attachment.money_request_value.to_id);
+            {
+                const auto& value =
+                    std::get<vk_data::money_request>(attachment.value);
+                ids.insert(value.from_id);
+                ids.insert(value.to_id);
                 break;
+            }
 
             case story:
-                ids.insert(attachment.story_value.owner_id);
+                ids.insert(std::get<vk_data::story>(attachment.value).owner_id);
                 break;
 
             default:
@@ -142,13 +169,15 @@ namespace vme::api
 
         for (const auto& fwd_message : message.fwd_messages)
         {
-            _collect_ids(*fwd_message.get(), ids);
+            _collect_ids(fwd_message, ids);
         }
     }
 
-    user_pool::user_pool(session& s, const std::string& access_token) :
+    user_pool::user_pool(
+        session& s, const std::string& access_token, bool deferred) :
         m_session(s),
-        m_access_token(access_token)
+        m_access_token(access_token),
+        m_deferred(deferred)
     {
     }
 
@@ -157,11 +186,29 @@ namespace vme::api
         std::unordered_set<std::int64_t> ids;
         _collect_ids(message, ids);
 
+        if (m_deferred)
+        {
+            for (auto id : ids)
+            {
+                if (!m_users.contains(id) && !m_requested.contains(id))
+                {
+                    m_pending.insert(id);
+                }
+            }
+
+            if (m_pending.size() >= MAX_USERS_PER_REQUEST)
+            {
+                resolve();
+            }
+
+            return;
+        }
+
         std::vector<std::int64_t> queried_ids;
         queried_ids.reserve(32);
         for (auto id : ids)
         {
-            if (!m_users.contains(id))
+            if (!m_users.contains(id) && !m_requested.contains(id))
             {
                 queried_ids.push_back(id);
             }
@@ -172,11 +219,39 @@ namespace vme::api
             return;
         }
 
+        request_users(queried_ids);
+    }
+
+    void user_pool::resolve()
+    {
+        std::vector<std::int64_t> queried_ids;
+        queried_ids.reserve(std::min(m_pending.size(), MAX_USERS_PER_REQUEST));
+
+        for (auto id : m_pending)
+        {
+            queried_ids.push_back(id);
+            if (queried_ids.size() == MAX_USERS_PER_REQUEST)
+            {
+                request_users(queried_ids);
+                queried_ids.clear();
+            }
+        }
+
+        if (queried_ids.size() != 0)
+        {
+            request_users(queried_ids);
+        }
+
+        m_pending.clear();
+    }
+
+    void user_pool::request_users(const std::vector<std::int64_t>& ids)
+    {
         std::stringstream id_list;
-        for (std::size_t i = 0; i < queried_ids.size(); i++)
+        for (std::size_t i = 0; i < ids.size(); i++)
         {
-            id_list << queried_ids[i];
-            if (i != queried_ids.size() - 1)
+            id_list << ids[i];
+            if (i != ids.size() - 1)
             {
                 id_list << ",";
             }
@@ -197,6 +272,20 @@ namespace vme::api
         {
             m_users[user.id] = user;
         }
+
+        m_requested.insert(ids.begin(), ids.end());
+    }
+
+    void user_pool::add_known(const std::vector<std::int64_t>& ids)
+    {
+        m_requested.insert(ids.begin(), ids.end());
+    }
+
+    void user_pool::add_pending(const std::vector<std::int64_t>& ids)
+    {
+        m_pending.insert(ids.begin(), ids.end());
     }
 
+    void user_pool::clear() noexcept { m_users.clear(); }
+
 }
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <cstdint>
+#include <cstddef>
 #include <string>
 
 #include "session.h"
@@ -23,7 +26,9 @@ namespace vme::api
     class user_pool
     {
     public:
-        user_pool(session& s, const std::string& access_token);
+        static constexpr std::size_t MAX_USERS_PER_REQUEST = 1000;
+
+        user_pool(session& s, const std::string& access_token, bool deferred);
 
         auto begin() const { return m_users.begin(); }
 
@@ -31,10 +36,31 @@ namespace vme::api
 
         void pull_users(const vk_data::message& message);
 
+        void resolve();
+
+        const std::unordered_set<std::int64_t>& pending() const noexcept
+        {
+            return m_pending;
+        }
+
+        // Marks ids as resolved elsewhere, e.g. by a previous run.
+        void add_known(const std::vector<std::int64_t>& ids);
+
+        void add_pending(const std::vector<std::int64_t>& ids);
+
+        // Drops resolved users once they are stored; their ids are not
+        // requested again.
+        void clear() noexcept;
+
     private:
+        void request_users(const std::vector<std::int64_t>& ids);
+
         session& m_session;
         std::string m_access_token;
+        bool m_deferred;
         std::unordered_map<std::int64_t, vk_data::user> m_users;
+        std::unordered_set<std::int64_t> m_pending;
+        std::unordered_set<std::int64_t> m_requested;
     };
 
 }
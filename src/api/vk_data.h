@@ -2,13 +2,30 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <optional>
 #include <vector>
 #include <memory>
+#include <variant>
+#include <deque>
+#include <memory_resource>
 
 namespace vme::api::vk_data
 {
 
+    // Message data is allocated from the arena of the page it is parsed
+    // from. A copy falls back to the default resource.
+    using allocator = std::pmr::polymorphic_allocator<>;
+
+    // A response together with the arenas of the messages parsed from it,
+    // one per parsing thread. Messages share ownership of their page, which
+    // is released in one go once the last of them is gone.
+    struct page
+    {
+        std::string response;
+        std::deque<std::pmr::monotonic_buffer_resource> arenas;
+    };
+
     struct user
     {
         std::int64_t id;
@@ -18,180 +35,291 @@ namespace vme::api::vk_data
 
     struct photo
     {
-        std::int64_t id;
-        std::int64_t owner_id;
-        std::int64_t date;
-        std::string url;
+        explicit photo(allocator alloc = {}) :
+            url(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t owner_id = 0;
+        std::int64_t date = 0;
+        std::pmr::string url;
     };
 
     struct video
     {
-        std::int64_t id;
-        std::int64_t owner_id;
-        std::int64_t date;
-        std::string title;
-        std::optional<std::string> description;
-        std::optional<std::string> image_url;
+        explicit video(allocator alloc = {}) :
+            title(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t owner_id = 0;
+        std::int64_t date = 0;
+        std::pmr::string title;
+        std::optional<std::pmr::string> description;
+        std::optional<std::pmr::string> image_url;
     };
 
     struct audio
     {
-        std::int64_t id;
-        std::int64_t owner_id;
-        std::string artist;
-        std::string title;
-        std::int64_t duration;
+        explicit audio(allocator alloc = {}) :
+            artist(alloc),
+            title(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t owner_id = 0;
+        std::pmr::string artist;
+        std::pmr::string title;
+        std::int64_t duration = 0;
     };
 
     struct document
     {
-        std::int64_t id;
-        std::int64_t owner_id;
-        std::int64_t date;
-        std::string title;
-        std::string ext;
-        std::string url;
+        explicit document(allocator alloc = {}) :
+            title(alloc),
+            ext(alloc),
+            url(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t owner_id = 0;
+        std::int64_t date = 0;
+        std::pmr::string title;
+        std::pmr::string ext;
+        std::pmr::string url;
     };
 
     struct link
     {
-        std::int64_t id;
-        std::string url;
-        std::string title;
-        std::optional<std::string> caption;
-        std::optional<std::string> description;
+        explicit link(allocator alloc = {}) :
+            url(alloc),
+            title(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::pmr::string url;
+        std::pmr::string title;
+        std::optional<std::pmr::string> caption;
+        std::optional<std::pmr::string> description;
     };
 
     struct product
     {
-        std::int64_t id;
-        std::int64_t owner_id;
-        std::string title;
-        std::string description;
-        std::string price;
-        std::string currency;
-        std::string category_name;
-        std::string category_section;
-        std::string thumb_url;
+        explicit product(allocator alloc = {}) :
+            title(alloc),
+            description(alloc),
+            price(alloc),
+            currency(alloc),
+            category_name(alloc),
+            category_section(alloc),
+            thumb_url(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t owner_id = 0;
+        std::pmr::string title;
+        std::pmr::string description;
+        std::pmr::string price;
+        std::pmr::string currency;
+        std::pmr::string category_name;
+        std::pmr::string category_section;
+        std::pmr::string thumb_url;
     };
 
     struct product_album
     {
-        std::int64_t id;
-        std::int64_t owner_id;
-        std::string title;
-        bool is_main;
-        bool is_hidden;
+        explicit product_album(allocator alloc = {}) :
+            title(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t owner_id = 0;
+        std::pmr::string title;
+        bool is_main = false;
+        bool is_hidden = false;
     };
 
     struct post
     {
-        std::int64_t id;
-        std::int64_t owner_id;
-        std::int64_t from_id;
-        std::int64_t date;
-        std::string text;
+        explicit post(allocator alloc = {}) :
+            text(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t owner_id = 0;
+        std::int64_t from_id = 0;
+        std::int64_t date = 0;
+        std::pmr::string text;
     };
 
     struct comment
     {
-        std::int64_t id;
-        std::int64_t from_id;
-        std::int64_t date;
-        std::string text;
+        explicit comment(allocator alloc = {}) :
+            text(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t from_id = 0;
+        std::int64_t date = 0;
+        std::pmr::string text;
     };
 
     struct sticker
     {
-        std::int64_t id;
-        std::string url;
+        explicit sticker(allocator alloc = {}) :
+            url(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::pmr::string url;
     };
 
     struct gift
     {
-        std::int64_t id;
-        std::string url;
+        explicit gift(allocator alloc = {}) :
+            url(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::pmr::string url;
     };
 
     struct call
     {
-        std::int64_t id;
-        std::int64_t initiator_id;
-        std::int64_t receiver_id;
-        std::string state;
-        std::int64_t time;
-        std::int64_t duration;
-        bool video;
+        explicit call(allocator alloc = {}) :
+            state(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t initiator_id = 0;
+        std::int64_t receiver_id = 0;
+        std::pmr::string state;
+        std::int64_t time = 0;
+        std::int64_t duration = 0;
+        bool video = false;
     };
 
     struct audio_message
     {
-        std::int64_t id;
-        std::int64_t owner_id;
-        std::int64_t duration;
-        std::vector<std::uint16_t> waveform;
-        std::string link_mp3;
+        explicit audio_message(allocator alloc = {}) :
+            waveform(alloc),
+            link_mp3(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t owner_id = 0;
+        std::int64_t duration = 0;
+        std::pmr::vector<std::uint16_t> waveform;
+        std::pmr::string link_mp3;
     };
 
     struct audio_playlist
     {
-        std::int64_t id;
-        std::int64_t owner_id;
-        std::int64_t create_time;
-        std::int64_t update_time;
+        explicit audio_playlist(allocator alloc = {}) :
+            title(alloc),
+            description(alloc),
+            audios(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t owner_id = 0;
+        std::int64_t create_time = 0;
+        std::int64_t update_time = 0;
         std::optional<std::int64_t> year;
-        std::string title;
-        std::string description;
-        std::vector<audio> audios;
+        std::pmr::string title;
+        std::pmr::string description;
+        std::pmr::vector<audio> audios;
     };
 
     struct graffiti
     {
-        std::int64_t id;
-        std::int64_t owner_id;
-        std::string url;
+        explicit graffiti(allocator alloc = {}) :
+            url(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t owner_id = 0;
+        std::pmr::string url;
     };
 
     struct money_request
     {
-        std::int64_t id;
-        std::int64_t from_id;
-        std::int64_t to_id;
-        std::string amount;
-        std::string currency;
+        explicit money_request(allocator alloc = {}) :
+            amount(alloc),
+            currency(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t from_id = 0;
+        std::int64_t to_id = 0;
+        std::pmr::string amount;
+        std::pmr::string currency;
     };
 
     struct story
     {
-        std::int64_t id;
-        std::int64_t owner_id;
-        std::int64_t date;
-        std::int64_t expires_at;
+        std::int64_t id = 0;
+        std::int64_t owner_id = 0;
+        std::int64_t date = 0;
+        std::int64_t expires_at = 0;
     };
 
     struct poll_answer
     {
-        std::int64_t id;
-        float rate;
-        std::string text;
-        std::int64_t votes;
+        explicit poll_answer(allocator alloc = {}) :
+            text(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        float rate = 0;
+        std::pmr::string text;
+        std::int64_t votes = 0;
     };
 
     struct poll
     {
-        std::int64_t id;
-        std::int64_t owner_id;
-        std::string question;
-        std::int64_t votes;
-        std::vector<poll_answer> answers;
+        explicit poll(allocator alloc = {}) :
+            question(alloc),
+            answers(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::int64_t owner_id = 0;
+        std::pmr::string question;
+        std::int64_t votes = 0;
+        std::pmr::vector<poll_answer> answers;
     };
 
     struct event
     {
-        std::int64_t id;
-        std::string button_text;
-        std::string text;
-        std::int64_t member_status;
+        explicit event(allocator alloc = {}) :
+            button_text(alloc),
+            text(alloc)
+        {
+        }
+
+        std::int64_t id = 0;
+        std::pmr::string button_text;
+        std::pmr::string text;
+        std::int64_t member_status = 0;
     };
 
     enum class attachment_type
@@ -222,42 +350,56 @@ namespace vme::api::vk_data
     std::optional<attachment_type> attachment_type_from_string(
         const std::string& type) noexcept;
 
+    // Alternatives are listed in attachment_type order.
     struct attachment
     {
-        attachment_type type;
-        photo photo_value;
-        video video_value;
-        audio audio_value;
-        document document_value;
-        link link_value;
-        product product_value;
-        product_album product_album_value;
-        post post_value;
-        comment comment_value;
-        sticker sticker_value;
-        gift gift_value;
-        call call_value;
-        audio_message audio_message_value;
-        audio_playlist audio_playlist_value;
-        graffiti graffiti_value;
-        money_request money_request_value;
-        story story_value;
-        poll poll_value;
-        event event_value;
+        std::variant<photo, video, audio, document, link, product,
+            product_album, post, comment, sticker, gift, call, audio_message,
+            audio_playlist, graffiti, money_request, story, poll, event>
+            value;
+
+        attachment_type type() const noexcept
+        {
+            return static_cast<attachment_type>(value.index());
+        }
     };
 
     struct message
     {
+        explicit message(allocator alloc = {}) :
+            text(alloc),
+            fwd_messages(alloc),
+            attachments(alloc)
+        {
+        }
+
+        // Messages are only ever moved on. A copy would deep copy the
+        // whole graph out of the arenas of its page. Assignment would
+        // release the old page before the members allocated from it, and
+        // copy into its arenas instead of moving, so it is not provided.
+        message(const message& other) = delete;
+
+        message(message&& other) = default;
+
+        message& operator=(const message& other) = delete;
+
+        message& operator=(message&& other) = delete;
+
+        // Declared first so that it is released last, after the members
+        // allocated from its arenas. original_json points into its
+        // response.
+        std::shared_ptr<page> source;
+
         std::optional<std::int64_t> id;
-        std::int64_t from_id;
-        std::int64_t conversation_message_id;
-        std::int64_t date;
-        bool important;
-        std::string text;
+        std::int64_t from_id = 0;
+        std::int64_t conversation_message_id = 0;
+        std::int64_t date = 0;
+        bool important = false;
+        std::pmr::string text;
         std::optional<std::int64_t> reply_conversation_message_id;
-        std::vector<std::shared_ptr<message>> fwd_messages;
-        std::vector<attachment> attachments;
-        std::string original_json;
+        std::pmr::vector<message> fwd_messages;
+        std::pmr::vector<attachment> attachments;
+        std::string_view original_json;
     };
 
 }
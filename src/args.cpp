@@ -20,6 +20,58 @@ namespace vme
         return arg;
     }
 
+    static bool _parse_bool(const std::string& name, const std::string& value,
+        const std::string& help)
+    {
+        if (value == "true")
+        {
+            return true;
+        }
+
+        if (value == "false")
+        {
+            return false;
+        }
+
+        throw args_parse_error(std::format(
+            "Invalid argument: {} is not a boolean\n{}", name, help));
+    }
+
+    static std::size_t _parse_count(const std::string& name,
+        const std::string& value, std::size_t min, std::size_t max,
+        const std::string& help)
+    {
+        std::size_t result;
+        try
+        {
+            std::size_t pos = 0;
+            if (value.empty() || value[0] < '0' || value[0] > '9')
+            {
+                throw std::invalid_argument(value);
+            }
+
+            result = std::stoull(value, &pos);
+            if (pos != value.length())
+            {
+                throw std::invalid_argument(value);
+            }
+        }
+        catch (const std::logic_error&)
+        {
+            throw args_parse_error(std::format(
+                "Invalid argument: {} is not an integer\n{}", name, help));
+        }
+
+        if (result < min || result > max)
+        {
+            throw args_parse_error(
+                std::format("Invalid argument: {} is not in range [{}, {}]\n{}",
+                    name, min, max, help));
+        }
+
+        return result;
+    }
+
     args::args(int argc, char** argv) :
         m_program_name(_adv_args(&argc, &argv).value())
     {
@@ -30,6 +82,19 @@ namespace vme
         std::string peer_id;
         std::string storage_root = "./";
         std::string show_progress = "true";
+        std::string max_downloads = "16";
+        std::string stream_media = "false";
+        std::string history_batch = "1";
+        std::string read_ahead = "0";
+        std::string parallel_fetch = "1";
+        std::string defer_users = "false";
+        std::string rate_limit = "3";
+        std::string transaction_size = "1000";
+        std::string transaction_interval = "5000";
+        std::string incremental = "false";
+        std::string parse_threads = "1";
+        std::string write_queue = "0";
+        std::string host_downloads = "16";
 
         while (true)
         {
@@ -70,6 +135,71 @@ namespace vme
             {
                 show_progress = value.value();
             }
+            else if (arg.value() == MAX_DOWNLOADS_ARG ||
+                     arg.value() == MAX_DOWNLOADS_ARG_SHORT)
+            {
+                max_downloads = value.value();
+            }
+            else if (arg.value() == STREAM_MEDIA_ARG ||
+                     arg.value() == STREAM_MEDIA_ARG_SHORT)
+            {
+                stream_media = value.value();
+            }
+            else if (arg.value() == HISTORY_BATCH_ARG ||
+                     arg.value() == HISTORY_BATCH_ARG_SHORT)
+            {
+                history_batch = value.value();
+            }
+            else if (arg.value() == READ_AHEAD_ARG ||
+                     arg.value() == READ_AHEAD_ARG_SHORT)
+            {
+                read_ahead = value.value();
+            }
+            else if (arg.value() == PARALLEL_FETCH_ARG ||
+                     arg.value() == PARALLEL_FETCH_ARG_SHORT)
+            {
+                parallel_fetch = value.value();
+            }
+            else if (arg.value() == DEFER_USERS_ARG ||
+                     arg.value() == DEFER_USERS_ARG_SHORT)
+            {
+                defer_users = value.value();
+            }
+            else if (arg.value() == RATE_LIMIT_ARG ||
+                     arg.value() == RATE_LIMIT_ARG_SHORT)
+            {
+                rate_limit = value.value();
+            }
+            else if (arg.value() == TRANSACTION_SIZE_ARG ||
+                     arg.value() == TRANSACTION_SIZE_ARG_SHORT)
+            {
+                transaction_size = value.value();
+            }
+            else if (arg.value() == TRANSACTION_INTERVAL_ARG ||
+                     arg.value() == TRANSACTION_INTERVAL_ARG_SHORT)
+            {
+                transaction_interval = value.value();
+            }
+            else if (arg.value() == INCREMENTAL_ARG ||
+                     arg.value() == INCREMENTAL_ARG_SHORT)
+            {
+                incremental = value.value();
+            }
+            else if (arg.value() == PARSE_THREADS_ARG ||
+                     arg.value() == PARSE_THREADS_ARG_SHORT)
+            {
+                parse_threads = value.value();
+            }
+            else if (arg.value() == WRITE_QUEUE_ARG ||
+                     arg.value() == WRITE_QUEUE_ARG_SHORT)
+            {
+                write_queue = value.value();
+            }
+            else if (arg.value() == HOST_DOWNLOADS_ARG ||
+                     arg.value() == HOST_DOWNLOADS_ARG_SHORT)
+            {
+                host_downloads = value.value();
+            }
             else
             {
                 throw args_parse_error(std::format(
@@ -113,26 +243,53 @@ namespace vme
                 help()));
         }
 
-        bool show_progress_parsed;
-        if (show_progress == "true")
-        {
-            show_progress_parsed = true;
-        }
-        else if (show_progress == "false")
-        {
-            show_progress_parsed = false;
-        }
-        else
-        {
-            throw args_parse_error(std::format(
-                "Invalid argument: show_progress is not a boolean\n{}",
-                help()));
-        }
+        bool show_progress_parsed =
+            _parse_bool("show_progress", show_progress, help());
+
+        std::size_t max_downloads_parsed =
+            _parse_count("max_downloads", max_downloads, 1, 1024, help());
+        bool stream_media_parsed =
+            _parse_bool("stream_media", stream_media, help());
+        std::size_t history_batch_parsed =
+            _parse_count("history_batch", history_batch, 1, 25, help());
+        std::size_t read_ahead_parsed =
+            _parse_count("read_ahead", read_ahead, 0, 64, help());
+        std::size_t parallel_fetch_parsed =
+            _parse_count("parallel_fetch", parallel_fetch, 1, 16, help());
+        bool defer_users_parsed =
+            _parse_bool("defer_users", defer_users, help());
+        std::size_t rate_limit_parsed =
+            _parse_count("rate_limit", rate_limit, 1, 100, help());
+        std::size_t transaction_size_parsed = _parse_count(
+            "transaction_size", transaction_size, 1, 1000000, help());
+        std::size_t transaction_interval_parsed = _parse_count(
+            "transaction_interval", transaction_interval, 0, 3600000, help());
+        bool incremental_parsed =
+            _parse_bool("incremental", incremental, help());
+        std::size_t parse_threads_parsed =
+            _parse_count("parse_threads", parse_threads, 1, 64, help());
+        std::size_t write_queue_parsed =
+            _parse_count("write_queue", write_queue, 0, 100000, help());
+        std::size_t host_downloads_parsed =
+            _parse_count("host_downloads", host_downloads, 1, 1024, help());
 
         m_access_token = access_token;
         m_peer_id = peer_id_parsed;
         m_storage_root = storage_root;
         m_show_progress = show_progress_parsed;
+        m_max_downloads = max_downloads_parsed;
+        m_stream_media = stream_media_parsed;
+        m_history_batch = history_batch_parsed;
+        m_read_ahead = read_ahead_parsed;
+        m_parallel_fetch = parallel_fetch_parsed;
+        m_defer_users = defer_users_parsed;
+        m_rate_limit = rate_limit_parsed;
+        m_transaction_size = transaction_size_parsed;
+        m_transaction_interval = transaction_interval_parsed;
+        m_incremental = incremental_parsed;
+        m_parse_threads = parse_threads_parsed;
+        m_write_queue = write_queue_parsed;
+        m_host_downloads = host_downloads_parsed;
     }
 
     std::string args::program_name() const noexcept { return m_program_name; }
@@ -145,10 +302,57 @@ namespace vme
 
     bool args::show_progress() const noexcept { return m_show_progress; }
 
+    std::size_t args::max_downloads() const noexcept
+    {
+        return m_max_downloads;
+    }
+
+    bool args::stream_media() const noexcept { return m_stream_media; }
+
+    std::size_t args::history_batch() const noexcept
+    {
+        return m_history_batch;
+    }
+
+    std::size_t args::read_ahead() const noexcept { return m_read_ahead; }
+
+    std::size_t args::parallel_fetch() const noexcept
+    {
+        return m_parallel_fetch;
+    }
+
+    bool args::defer_users() const noexcept { return m_defer_users; }
+
+    std::size_t args::rate_limit() const noexcept { return m_rate_limit; }
+
+    std::size_t args::transaction_size() const noexcept
+    {
+        return m_transaction_size;
+    }
+
+    std::size_t args::transaction_interval() const noexcept
+    {
+        return m_transaction_interval;
+    }
+
+    bool args::incremental() const noexcept { return m_incremental; }
+
+    std::size_t args::parse_threads() const noexcept
+    {
+        return m_parse_threads;
+    }
+
+    std::size_t args::write_queue() const noexcept { return m_write_queue; }
+
+    std::size_t args::host_downloads() const noexcept
+    {
+        return m_host_downloads;
+    }
+
     std::string args::help() const noexcept
     {
         return std::format(
-            R""""(Usage: {} -access_token <value> -peer_id <value> [-storage_root <value>] [-show_progress <true|false>]
+            R""""(Usage: {} -access_token <value> -peer_id <value> [-storage_root <value>] [-show_progress <true|false>] [-max_downloads <value>] [-stream_media <true|false>] [-history_batch <value>] [-read_ahead <value>] [-parallel_fetch <value>] [-defer_users <true|false>] [-rate_limit <value>] [-transaction_size <value>] [-transaction_interval <value>] [-incremental <true|false>] [-parse_threads <value>] [-write_queue <value>] [-host_downloads <value>]
 -access_token  -t (string)  REQUIRED :
     Sets access token for VK API.
 -peer_id       -p (integer) REQUIRED :
@@ -158,7 +362,54 @@ namespace vme
     (Default: current working directory)
 -show_progress -s (boolean) OPTIONAL :
     Shows progress when set to true
-    (Default: true))"""",
+    (Default: true)
+-max_downloads -d (integer) OPTIONAL :
+    Sets maximum number of concurrent media downloads.
+    (Default: 16)
+-stream_media  -m (boolean) OPTIONAL :
+    Downloads media in background while messages are being fetched
+    when set to true.
+    (Default: false)
+-history_batch -b (integer) OPTIONAL :
+    Sets number of history pages (up to 25) fetched per API request.
+    (Default: 1)
+-read_ahead    -a (integer) OPTIONAL :
+    Sets number of history requests fetched in background ahead of
+    processing. Disabled when set to 0.
+    (Default: 0)
+-parallel_fetch -j (integer) OPTIONAL :
+    Sets number of history requests performed concurrently.
+    (Default: 1)
+-defer_users   -u (boolean) OPTIONAL :
+    Resolves users in batches of up to 1000 ids instead of once per
+    message when set to true.
+    (Default: false)
+-rate_limit    -l (integer) OPTIONAL :
+    Sets maximum number of API requests per second.
+    (Default: 3)
+-transaction_size -n (integer) OPTIONAL :
+    Sets number of messages written per database transaction.
+    (Default: 1000)
+-transaction_interval -i (integer) OPTIONAL :
+    Sets maximum time in milliseconds a database transaction is kept
+    open.
+    (Default: 5000)
+-incremental   -c (boolean) OPTIONAL :
+    Keeps existing database and continues export from the last
+    checkpoint when set to true. Media already on disk is skipped.
+    (Default: false)
+-parse_threads -w (integer) OPTIONAL :
+    Sets number of threads parsing each history response.
+    (Default: 1)
+-write_queue   -q (integer) OPTIONAL :
+    Sets number of database writes queued for a background writer
+    thread. Writes are done on the main thread when set to 0.
+    (Default: 0)
+-host_downloads -o (integer) OPTIONAL :
+    Sets maximum number of concurrent media downloads from one host.
+    Downloads from a host share one HTTP/2 connection when the host
+    supports it.
+    (Default: 16)"""",
             m_program_name);
     }
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
 #include <string>
 
 #include "error.h"
@@ -32,6 +33,32 @@ namespace vme
 
         bool show_progress() const noexcept;
 
+        std::size_t max_downloads() const noexcept;
+
+        bool stream_media() const noexcept;
+
+        std::size_t history_batch() const noexcept;
+
+        std::size_t read_ahead() const noexcept;
+
+        std::size_t parallel_fetch() const noexcept;
+
+        bool defer_users() const noexcept;
+
+        std::size_t rate_limit() const noexcept;
+
+        std::size_t transaction_size() const noexcept;
+
+        std::size_t transaction_interval() const noexcept;
+
+        bool incremental() const noexcept;
+
+        std::size_t parse_threads() const noexcept;
+
+        std::size_t write_queue() const noexcept;
+
+        std::size_t host_downloads() const noexcept;
+
         std::string help() const noexcept;
 
     private:
@@ -43,12 +70,53 @@ namespace vme
         static inline const std::string STORAGE_ROOT_ARG_SHORT = "-r";
         static inline const std::string SHOW_PROGRESS_ARG = "-show_progress";
         static inline const std::string SHOW_PROGRESS_ARG_SHORT = "-s";
+        static inline const std::string MAX_DOWNLOADS_ARG = "-max_downloads";
+        static inline const std::string MAX_DOWNLOADS_ARG_SHORT = "-d";
+        static inline const std::string STREAM_MEDIA_ARG = "-stream_media";
+        static inline const std::string STREAM_MEDIA_ARG_SHORT = "-m";
+        static inline const std::string HISTORY_BATCH_ARG = "-history_batch";
+        static inline const std::string HISTORY_BATCH_ARG_SHORT = "-b";
+        static inline const std::string READ_AHEAD_ARG = "-read_ahead";
+        static inline const std::string READ_AHEAD_ARG_SHORT = "-a";
+        static inline const std::string PARALLEL_FETCH_ARG = "-parallel_fetch";
+        static inline const std::string PARALLEL_FETCH_ARG_SHORT = "-j";
+        static inline const std::string DEFER_USERS_ARG = "-defer_users";
+        static inline const std::string DEFER_USERS_ARG_SHORT = "-u";
+        static inline const std::string RATE_LIMIT_ARG = "-rate_limit";
+        static inline const std::string RATE_LIMIT_ARG_SHORT = "-l";
+        static inline const std::string TRANSACTION_SIZE_ARG =
+            "-transaction_size";
+        static inline const std::string TRANSACTION_SIZE_ARG_SHORT = "-n";
+        static inline const std::string TRANSACTION_INTERVAL_ARG =
+            "-transaction_interval";
+        static inline const std::string TRANSACTION_INTERVAL_ARG_SHORT = "-i";
+        static inline const std::string INCREMENTAL_ARG = "-incremental";
+        static inline const std::string INCREMENTAL_ARG_SHORT = "-c";
+        static inline const std::string PARSE_THREADS_ARG = "-parse_threads";
+        static inline const std::string PARSE_THREADS_ARG_SHORT = "-w";
+        static inline const std::string WRITE_QUEUE_ARG = "-write_queue";
+        static inline const std::string WRITE_QUEUE_ARG_SHORT = "-q";
+        static inline const std::string HOST_DOWNLOADS_ARG = "-host_downloads";
+        static inline const std::string HOST_DOWNLOADS_ARG_SHORT = "-o";
 
         std::string m_program_name;
         std::string m_access_token;
         std::int64_t m_peer_id;
         std::string m_storage_root;
         bool m_show_progress;
+        std::size_t m_max_downloads;
+        bool m_stream_media;
+        std::size_t m_history_batch;
+        std::size_t m_read_ahead;
+        std::size_t m_parallel_fetch;
+        bool m_defer_users;
+        std::size_t m_rate_limit;
+        std::size_t m_transaction_size;
+        std::size_t m_transaction_interval;
+        bool m_incremental;
+        std::size_t m_parse_threads;
+        std::size_t m_write_queue;
+        std::size_t m_host_downloads;
     };
 
 }
@@ -2,43 +2,204 @@
 
 #include <cstdlib>
 #include <cstddef>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
 #include <format>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+#include <optional>
+#include <mutex>
+#include <vector>
 
 #include <curl/curl.h>
 
 namespace vme
 {
 
+    struct response_target
+    {
+        CURL* handle;
+        std::string& body;
+    };
+
     static size_t _curl_write_function(void* buffer, std::size_t size,
         std::size_t nmemb, void* user_data) noexcept
     {
-        std::ostream& data_stream = *reinterpret_cast<std::ostream*>(user_data);
-        data_stream.write(reinterpret_cast<char*>(buffer), nmemb);
+        response_target& target =
+            *reinterpret_cast<response_target*>(user_data);
+
+        try
+        {
+            // Headers are in by the first write, so the body is reserved
+            // once. A compressed body still has to grow past it.
+            if (target.body.empty())
+            {
+                curl_off_t length = -1;
+                curl_easy_getinfo(target.handle,
+                    CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+                if (length > 0)
+                {
+                    target.body.reserve(static_cast<std::size_t>(length));
+                }
+            }
+
+            target.body.append(reinterpret_cast<char*>(buffer), nmemb);
+        }
+        catch (...)
+        {
+            return 0;
+        }
+
         return nmemb;
     }
 
-    curl::curl() :
-        m_curl(nullptr)
+    // Files are unbuffered, each chunk goes straight to the descriptor.
+    static size_t _curl_file_write_function(void* buffer, std::size_t,
+        std::size_t nmemb, void* user_data) noexcept
+    {
+        std::FILE* file = reinterpret_cast<std::FILE*>(user_data);
+        return std::fwrite(buffer, 1, nmemb, file);
+    }
+
+    // A stalled connection or transfer ends in CURLE_OPERATION_TIMEDOUT
+    // instead of waiting forever. A transfer is stalled when it receives
+    // less than LOW_SPEED_LIMIT bytes per second for LOW_SPEED_TIME seconds.
+    static constexpr long CONNECT_TIMEOUT = 30;
+    static constexpr long LOW_SPEED_LIMIT = 1024;
+    static constexpr long LOW_SPEED_TIME = 60;
+
+    static void _set_timeouts(CURL* handle) noexcept
+    {
+        curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT);
+        curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, LOW_SPEED_LIMIT);
+        curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, LOW_SPEED_TIME);
+    }
+
+    static std::once_flag curl_initialized;
+
+    // All handles share DNS lookups and TLS sessions. Released handles are
+    // kept with their open connections and handed out again, so repeated
+    // requests to a host skip connection setup. The connection cache
+    // itself is not shared, libcurl does not support sharing it between
+    // concurrent threads.
+    static CURLSH* curl_share = nullptr;
+    static std::mutex curl_share_mutexes[CURL_LOCK_DATA_LAST];
+    static std::mutex idle_handles_mutex;
+    static std::vector<CURL*> idle_handles;
+
+    static void _curl_share_lock(
+        CURL*, curl_lock_data data, curl_lock_access, void*) noexcept
+    {
+        curl_share_mutexes[data].lock();
+    }
+
+    static void _curl_share_unlock(CURL*, curl_lock_data data, void*) noexcept
+    {
+        curl_share_mutexes[data].unlock();
+    }
+
+    static void _curl_share_cleanup() noexcept
     {
-        if (!curl_initialized)
+        for (CURL* handle : idle_handles)
         {
-            CURLcode status = curl_global_init(CURL_GLOBAL_ALL);
-            if (status != CURLE_OK)
+            curl_easy_cleanup(handle);
+        }
+
+        idle_handles.clear();
+        curl_share_cleanup(curl_share);
+    }
+
+    static void _curl_global_init()
+    {
+        std::call_once(curl_initialized,
+            []
             {
-                throw curl_init_error(
-                    std::format("Failed to initialize CURL: {}",
-                        curl_easy_strerror(status)));
+                CURLcode status = curl_global_init(CURL_GLOBAL_ALL);
+                if (status != CURLE_OK)
+                {
+                    throw curl_init_error(
+                        std::format("Failed to initialize CURL: {}",
+                            curl_easy_strerror(status)));
+                }
+
+                std::atexit(curl_global_cleanup);
+
+                curl_share = curl_share_init();
+                if (curl_share == nullptr)
+                {
+                    throw curl_init_error("Failed to create CURL share handle");
+                }
+
+                curl_share_setopt(
+                    curl_share, CURLSHOPT_LOCKFUNC, _curl_share_lock);
+                curl_share_setopt(
+                    curl_share, CURLSHOPT_UNLOCKFUNC, _curl_share_unlock);
+                curl_share_setopt(
+                    curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+                curl_share_setopt(
+                    curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+                // Runs before curl_global_cleanup, registered earlier.
+                std::atexit(_curl_share_cleanup);
+            });
+    }
+
+    static CURL* _create_handle()
+    {
+        _curl_global_init();
+
+        CURL* handle = curl_easy_init();
+        if (handle == nullptr)
+        {
+            throw curl_init_error("Failed to create CURL handle");
+        }
+
+        curl_easy_setopt(handle, CURLOPT_SHARE, curl_share);
+        return handle;
+    }
+
+    static CURL* _acquire_handle()
+    {
+        {
+            std::lock_guard lock(idle_handles_mutex);
+            if (!idle_handles.empty())
+            {
+                CURL* handle = idle_handles.back();
+                idle_handles.pop_back();
+                return handle;
             }
+        }
 
-            std::atexit(curl_global_cleanup);
-            curl_initialized = true;
+        return _create_handle();
+    }
+
+    // A reset keeps the connections, caches and the share of a handle.
+    static void _release_handle(CURL* handle) noexcept
+    {
+        if (handle == nullptr)
+        {
+            return;
         }
 
-        m_curl = curl_easy_init();
-        if (m_curl == nullptr)
+        curl_easy_reset(handle);
+
+        try
         {
-            throw curl_init_error("Failed to create CURL handle");
+            std::lock_guard lock(idle_handles_mutex);
+            idle_handles.push_back(handle);
         }
+        catch (...)
+        {
+            curl_easy_cleanup(handle);
+        }
+    }
+
+    curl::curl() :
+        m_curl(_acquire_handle())
+    {
     }
 
     curl::curl(const curl& other) noexcept :
@@ -54,7 +215,7 @@ namespace vme
 
     curl& curl::operator=(const curl& other) noexcept
     {
-        curl_easy_cleanup(m_curl);
+        _release_handle(m_curl);
         m_curl = curl_easy_duphandle(other.m_curl);
 
         return *this;
@@ -62,7 +223,7 @@ namespace vme
 
     curl& curl::operator=(curl&& other) noexcept
     {
-        curl_easy_cleanup(m_curl);
+        _release_handle(m_curl);
         m_curl = other.m_curl;
         other.m_curl = nullptr;
 
@@ -71,19 +232,31 @@ namespace vme
 
     curl::~curl() noexcept
     {
-        if (m_curl != nullptr)
-        {
-            curl_easy_cleanup(m_curl);
-        }
+        _release_handle(m_curl);
     }
 
-    void curl::perform(const std::string& url, std::ostream& ostream)
+    void curl::perform(const std::string& url, std::string& body)
     {
+        body.clear();
+        response_target target { m_curl, body };
+
         curl_easy_setopt(m_curl, CURLOPT_URL, url.c_str());
         curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, _curl_write_function);
-        curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, &ostream);
+        curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, &target);
+
+        // Offers every encoding libcurl was built with. The body is decoded
+        // as it arrives, the stream gets it uncompressed.
+        curl_easy_setopt(m_curl, CURLOPT_ACCEPT_ENCODING, "");
+        _set_timeouts(m_curl);
 
         CURLcode status = curl_easy_perform(m_curl);
+        if (status == CURLE_OPERATION_TIMEDOUT)
+        {
+            throw curl_timeout_error(
+                std::format("Failed to perform on URL \"{}\": {}", url,
+                    curl_easy_strerror(status)));
+        }
+
         if (status != CURLE_OK)
         {
             throw curl_perform_error(
@@ -92,6 +265,390 @@ namespace vme
         }
     }
 
-    bool curl::curl_initialized = false;
+    static std::string _part_path(const std::string& path)
+    {
+        return path + ".part";
+    }
+
+    // A URL libcurl cannot parse is grouped under an empty host, its
+    // transfer fails once started.
+    static std::string _url_host(const std::string& url)
+    {
+        std::string host;
+
+        CURLU* handle = curl_url();
+        char* part = nullptr;
+        if (handle != nullptr &&
+            curl_url_set(handle, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK &&
+            curl_url_get(handle, CURLUPART_HOST, &part, 0) == CURLUE_OK)
+        {
+            host = part;
+            curl_free(part);
+        }
+
+        curl_url_cleanup(handle);
+        return host;
+    }
+
+    std::size_t curl::received_bytes() const noexcept
+    {
+        curl_off_t bytes = 0;
+        curl_easy_getinfo(m_curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+        return static_cast<std::size_t>(bytes);
+    }
+
+    curl_multi::curl_multi(
+        std::size_t max_transfers, std::size_t max_host_transfers) :
+        m_multi(nullptr),
+        m_max_transfers(max_transfers),
+        m_max_host_transfers(max_host_transfers),
+        m_queued(0)
+    {
+        _curl_global_init();
+
+        m_multi = curl_multi_init();
+        if (m_multi == nullptr)
+        {
+            throw curl_init_error("Failed to create CURL multi handle");
+        }
+
+        curl_multi_setopt(m_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    }
+
+    curl_multi::~curl_multi() noexcept
+    {
+        for (const auto& [handle, transfer] : m_transfers)
+        {
+            curl_multi_remove_handle(m_multi, handle);
+            curl_easy_cleanup(handle);
+        }
+
+        for (void* handle : m_idle_handles)
+        {
+            curl_easy_cleanup(handle);
+        }
+
+        curl_multi_cleanup(m_multi);
+    }
+
+    void curl_multi::add(const std::string& url, const std::string& path)
+    {
+        m_queues[_url_host(url)].push_back({ url, path, 0, {} });
+        m_queued++;
+    }
+
+    std::vector<curl_multi::result> curl_multi::perform(int timeout_ms)
+    {
+        start_transfers();
+
+        int running = 0;
+        CURLMcode status = curl_multi_perform(m_multi, &running);
+        if (status != CURLM_OK)
+        {
+            throw curl_perform_error(
+                std::format("Failed to perform transfers: {}",
+                    curl_multi_strerror(status)));
+        }
+
+        std::vector<result> finished_transfers;
+        int queued = 0;
+        while (CURLMsg* message = curl_multi_info_read(m_multi, &queued))
+        {
+            if (message->msg != CURLMSG_DONE)
+            {
+                continue;
+            }
+
+            CURL* handle = message->easy_handle;
+            CURLcode result = message->data.result;
+
+            curl_multi_remove_handle(m_multi, handle);
+            m_idle_handles.push_back(handle);
+
+            auto it = m_transfers.find(handle);
+            std::unique_ptr<transfer> finished = std::move(it->second);
+            m_transfers.erase(it);
+
+            if (--m_host_transfers[finished->host] == 0)
+            {
+                m_host_transfers.erase(finished->host);
+            }
+
+            finished->file.reset();
+            std::string part_path = _part_path(finished->path);
+
+            if (result == CURLE_WRITE_ERROR)
+            {
+                throw curl_perform_error(std::format(
+                    "Failed to write file \"{}\"", part_path));
+            }
+
+            // libcurl takes a 416 to a resumed request as the file being
+            // complete, which it may not be, so the part file is replaced.
+            long response_code = 0;
+            curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &response_code);
+            if (result == CURLE_OK && response_code == 416)
+            {
+                result = CURLE_RANGE_ERROR;
+            }
+
+            if (result == CURLE_OK)
+            {
+                std::error_code error;
+                std::filesystem::rename(part_path, finished->path, error);
+                if (error)
+                {
+                    throw curl_perform_error(
+                        std::format("Failed to rename file \"{}\": {}",
+                            part_path, error.message()));
+                }
+
+                finished_transfers.push_back({ std::move(finished->path), {} });
+                continue;
+            }
+
+            std::optional<std::string> error =
+                retry(*finished, handle, result);
+            if (error.has_value())
+            {
+                finished_transfers.push_back(
+                    { std::move(finished->path), std::move(error.value()) });
+            }
+        }
+
+        if (finished_transfers.empty() &&
+            (!m_transfers.empty() || !m_retries.empty()))
+        {
+            // Nothing may be running while retries wait for their turn.
+            auto now = std::chrono::steady_clock::now();
+            for (const auto& waiting : m_retries)
+            {
+                auto delay =
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                        waiting.not_before - now);
+                timeout_ms = std::clamp(
+                    static_cast<int>(delay.count()), 0, timeout_ms);
+            }
+
+            status = curl_multi_poll(m_multi, nullptr, 0, timeout_ms, nullptr);
+            if (status != CURLM_OK)
+            {
+                throw curl_perform_error(
+                    std::format("Failed to poll transfers: {}",
+                        curl_multi_strerror(status)));
+            }
+        }
+
+        return finished_transfers;
+    }
+
+    bool curl_multi::done() const noexcept
+    {
+        return m_queued == 0 && m_retries.empty() && m_transfers.empty();
+    }
+
+    std::size_t curl_multi::size() const noexcept
+    {
+        return m_queued + m_retries.size() + m_transfers.size();
+    }
+
+    void curl_multi::start_transfers()
+    {
+        // Retries go ahead of the transfers of their host once due.
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = m_retries.begin(); it != m_retries.end();)
+        {
+            if (it->not_before > now)
+            {
+                ++it;
+                continue;
+            }
+
+            m_queues[_url_host(it->url)].push_front(std::move(*it));
+            m_queued++;
+            it = m_retries.erase(it);
+        }
+
+        // Hosts get a transfer each per round, so a host with a long
+        // backlog does not hold back the others.
+        bool started = true;
+        while (started && m_transfers.size() < m_max_transfers)
+        {
+            started = false;
+            for (auto it = m_queues.begin();
+                 it != m_queues.end() && m_transfers.size() < m_max_transfers;)
+            {
+                auto& [host, queue] = *it;
+                if (m_host_transfers[host] < m_max_host_transfers)
+                {
+                    queued_transfer queued = std::move(queue.front());
+                    queue.pop_front();
+                    m_queued--;
+
+                    start_transfer(std::move(queued), host);
+                    started = true;
+                }
+
+                if (queue.empty())
+                {
+                    it = m_queues.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+    }
+
+    void curl_multi::start_transfer(
+        queued_transfer&& queued, const std::string& host)
+    {
+        std::unique_ptr<transfer> t = std::make_unique<transfer>();
+        t->url = std::move(queued.url);
+        t->path = std::move(queued.path);
+        t->host = host;
+        t->attempt = queued.attempt;
+
+        // A part file left by a failed attempt or an earlier run is
+        // continued from where it ends.
+        std::string part_path = _part_path(t->path);
+        std::error_code error;
+        std::uintmax_t resume_from =
+            std::filesystem::file_size(part_path, error);
+        if (error)
+        {
+            resume_from = 0;
+        }
+
+        t->file.reset(std::fopen(part_path.c_str(), "ab"));
+        if (t->file == nullptr)
+        {
+            throw curl_perform_error(
+                std::format("Failed to open file \"{}\": {}", part_path,
+                    std::strerror(errno)));
+        }
+
+        std::setvbuf(t->file.get(), nullptr, _IONBF, 0);
+
+        // Transfer handles stay with the multi handle, whose connections
+        // they use, rather than going back to the shared pool.
+        CURL* handle = nullptr;
+        if (m_idle_handles.empty())
+        {
+            handle = _create_handle();
+        }
+        else
+        {
+            handle = m_idle_handles.back();
+            m_idle_handles.pop_back();
+        }
+
+        curl_easy_setopt(handle, CURLOPT_URL, t->url.c_str());
+        curl_easy_setopt(
+            handle, CURLOPT_WRITEFUNCTION, _curl_file_write_function);
+        curl_easy_setopt(handle, CURLOPT_WRITEDATA, t->file.get());
+
+        // Waits for a connection to the host that can multiplex the
+        // transfer rather than opening one of its own.
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+
+        // An error page must not end up in the part file.
+        curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(handle, CURLOPT_RESUME_FROM_LARGE,
+            static_cast<curl_off_t>(resume_from));
+        _set_timeouts(handle);
+
+        CURLMcode status = curl_multi_add_handle(m_multi, handle);
+        if (status != CURLM_OK)
+        {
+            curl_easy_cleanup(handle);
+            throw curl_perform_error(
+                std::format("Failed to start transfer of URL \"{}\": {}",
+                    t->url, curl_multi_strerror(status)));
+        }
+
+        m_transfers.emplace(handle, std::move(t));
+        m_host_transfers[host]++;
+    }
+
+    std::optional<std::string> curl_multi::retry(
+        transfer& finished, void* handle, int result)
+    {
+        long response_code = 0;
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &response_code);
+
+        bool transient = false;
+        bool restart = false;
+        switch (result)
+        {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SSL_CONNECT_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+            transient = true;
+            break;
+
+        // The server ignored the range or the part file is larger than
+        // the file, so it is downloaded from the start.
+        case CURLE_RANGE_ERROR:
+            restart = true;
+            break;
+
+        case CURLE_HTTP_RETURNED_ERROR:
+            transient = response_code == 408 || response_code == 429 ||
+                        response_code >= 500;
+            restart = response_code == 416;
+            break;
+
+        default:
+            break;
+        }
+
+        std::string part_path = _part_path(finished.path);
+        if ((transient || restart) && finished.attempt < MAX_RETRIES)
+        {
+            std::chrono::milliseconds delay(0);
+            if (restart)
+            {
+                std::error_code error;
+                std::filesystem::remove(part_path, error);
+            }
+            else
+            {
+                delay = std::min(
+                    std::chrono::milliseconds(1000 << finished.attempt),
+                    std::chrono::milliseconds(30000));
+            }
+
+            m_retries.push_back({ std::move(finished.url),
+                std::move(finished.path), finished.attempt + 1,
+                std::chrono::steady_clock::now() + delay });
+            return std::nullopt;
+        }
+
+        // A part file with data is kept for a later run to continue.
+        std::error_code error;
+        if (std::filesystem::file_size(part_path, error) == 0)
+        {
+            std::filesystem::remove(part_path, error);
+        }
+
+        std::string reason = curl_easy_strerror(static_cast<CURLcode>(result));
+        if (result == CURLE_HTTP_RETURNED_ERROR)
+        {
+            reason = std::format("HTTP {}", response_code);
+        }
+
+        return std::format("Failed to download URL \"{}\": {}", finished.url,
+            reason);
+    }
 
 }
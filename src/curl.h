@@ -1,7 +1,15 @@
 #pragma once
 
 #include <string>
-#include <ostream>
+#include <cstdio>
+#include <cstddef>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <map>
+#include <optional>
 
 #include "error.h"
 
@@ -26,6 +34,18 @@ namespace vme
         }
     };
 
+    // Thrown when a connection or transfer stalled.
+    class curl_timeout_error : public curl_perform_error
+    {
+    public:
+        curl_timeout_error(const std::string& message) noexcept :
+            curl_perform_error(message)
+        {
+        }
+    };
+
+    // Easy handle taken from a process-wide pool, returned to it on
+    // destruction.
     class curl
     {
     public:
@@ -41,12 +61,100 @@ namespace vme
 
         ~curl() noexcept;
 
-        void perform(const std::string& url, std::ostream& ostream);
+        // Replaces the contents of body with the response body.
+        void perform(const std::string& url, std::string& body);
 
-    private:
-        static bool curl_initialized;
+        // Size of the last response body as received, before decoding.
+        std::size_t received_bytes() const noexcept;
 
+    private:
         void* m_curl;
     };
 
+    // Transfers are grouped by host. Transfers to a host are multiplexed
+    // over one HTTP/2 connection where the host supports it, and at most
+    // max_host_transfers of them run at a time.
+    //
+    // A file is written to "<path>.part" and renamed to its path once
+    // complete. Transfers failing on a transient error are retried with
+    // exponential back-off, continuing the part file with a Range request.
+    class curl_multi
+    {
+    public:
+        static constexpr std::size_t MAX_RETRIES = 5;
+
+        struct result
+        {
+            std::string path;
+            // Empty when the file was downloaded.
+            std::string error;
+        };
+
+        curl_multi(std::size_t max_transfers, std::size_t max_host_transfers);
+
+        curl_multi(const curl_multi& other) = delete;
+
+        curl_multi& operator=(const curl_multi& other) = delete;
+
+        ~curl_multi() noexcept;
+
+        void add(const std::string& url, const std::string& path);
+
+        // Returns the transfers finished by this call. A failed transfer
+        // failed for good or ran out of retries, a failure to write its
+        // file is thrown instead.
+        std::vector<result> perform(int timeout_ms);
+
+        bool done() const noexcept;
+
+        // Number of transfers added and not completed yet.
+        std::size_t size() const noexcept;
+
+    private:
+        struct file_closer
+        {
+            void operator()(std::FILE* file) const noexcept
+            {
+                std::fclose(file);
+            }
+        };
+
+        struct queued_transfer
+        {
+            std::string url;
+            std::string path;
+            std::size_t attempt;
+            std::chrono::steady_clock::time_point not_before;
+        };
+
+        struct transfer
+        {
+            std::string url;
+            std::string path;
+            std::string host;
+            std::size_t attempt;
+            std::unique_ptr<std::FILE, file_closer> file;
+        };
+
+        void start_transfers();
+
+        void start_transfer(queued_transfer&& queued, const std::string& host);
+
+        // Queues the transfer again or returns why it failed for good.
+        std::optional<std::string> retry(
+            transfer& finished, void* handle, int result);
+
+        void* m_multi;
+        std::size_t m_max_transfers;
+        std::size_t m_max_host_transfers;
+
+        // Queued transfers by host, taken from the hosts in turn.
+        std::map<std::string, std::deque<queued_transfer>> m_queues;
+        std::size_t m_queued;
+        std::vector<queued_transfer> m_retries;
+        std::unordered_map<std::string, std::size_t> m_host_transfers;
+        std::vector<void*> m_idle_handles;
+        std::unordered_map<void*, std::unique_ptr<transfer>> m_transfers;
+    };
+
 }
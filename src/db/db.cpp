@@ -4,6 +4,9 @@
 #include <cstdint>
 #include <cstddef>
 #include <filesystem>
+#include <string_view>
+#include <utility>
+#include <memory>
 
 #include <sqlite3.h>
 
@@ -57,12 +60,20 @@ namespace vme::db
         double value;
     };
 
+    // Text is bound without copying, so the referenced string has to
+    // outlive the sql_result of the statement it is bound to.
     class sql_text
     {
     public:
+        sql_text(std::string_view value) :
+            is_null(false),
+            value(value)
+        {
+        }
+
         sql_text(const std::string& value) :
-            value(value),
-            is_null(false)
+            is_null(false),
+            value(value)
         {
         }
 
@@ -72,7 +83,7 @@ namespace vme::db
         }
 
         bool is_null;
-        std::string value;
+        std::string_view value;
     };
 
     class sql_blob
@@ -126,8 +137,8 @@ namespace vme::db
             return sqlite3_bind_null(stmt, pos);
         }
 
-        return sqlite3_bind_text(stmt, pos, value.value.c_str(),
-            value.value.length(), SQLITE_TRANSIENT);
+        return sqlite3_bind_text(stmt, pos, value.value.data(),
+            value.value.length(), SQLITE_STATIC);
     }
 
     template<>
@@ -154,7 +165,8 @@ namespace vme::db
         sql_result(const sql_result& other) = delete;
 
         sql_result(sql_result&& other) :
-            m_stmt(other.m_stmt)
+            m_stmt(other.m_stmt),
+            m_is_row(other.m_is_row)
         {
             other.m_stmt = nullptr;
         }
@@ -164,6 +176,7 @@ namespace vme::db
         sql_result& operator=(sql_result&& other)
         {
             m_stmt = other.m_stmt;
+            m_is_row = other.m_is_row;
             other.m_stmt = nullptr;
 
             return *this;
@@ -173,10 +186,13 @@ namespace vme::db
         {
             if (m_stmt != nullptr)
             {
-                sqlite3_finalize(m_stmt);
+                sqlite3_reset(m_stmt);
+                sqlite3_clear_bindings(m_stmt);
             }
         }
 
+        bool is_row() const noexcept { return m_is_row; }
+
         bool get_bool(std::size_t col)
         {
             if (!m_is_row)
@@ -222,6 +238,20 @@ namespace vme::db
             return text ? reinterpret_cast<const char*>(text) : "";
         }
 
+        bool next()
+        {
+            int status = sqlite3_step(m_stmt);
+            if (status != SQLITE_DONE && status != SQLITE_ROW)
+            {
+                throw db_operation_error(
+                    std::format("Database operation error: {}",
+                        sqlite3_errmsg(sqlite3_db_handle(m_stmt))));
+            }
+
+            m_is_row = status == SQLITE_ROW;
+            return m_is_row;
+        }
+
     private:
         bool m_is_row;
         sqlite3_stmt* m_stmt;
@@ -229,26 +259,20 @@ namespace vme::db
 
     template<class... Args>
     sql_result _execute_stmt(
-        sqlite3* db, const std::string& stmt, Args&&... args)
+        sqlite3* db, sqlite3_stmt* statement, Args&&... args)
     {
-        sqlite3_stmt* statement = nullptr;
-        int status = sqlite3_prepare_v2(
-            db, stmt.c_str(), stmt.length(), &statement, nullptr);
+        // A cached statement may still hold the state of an enclosing
+        // call, e.g. when a forwarded message is stored recursively.
+        sqlite3_reset(statement);
 
-        if (status != SQLITE_OK)
-        {
-            throw db_operation_error(std::format(
-                "Database operation error: {}", sqlite3_errmsg(db)));
-        }
-
-        int i = 1;
+        [[maybe_unused]] int i = 1;
         (static_cast<void>(
              [&]
              {
                  int status = _bind_stmt(statement, i, args);
                  if (status != SQLITE_OK)
                  {
-                     sqlite3_finalize(statement);
+                     sqlite3_clear_bindings(statement);
                      throw db_operation_error(std::format(
                          "Database operation error: {}", sqlite3_errmsg(db)));
                  }
@@ -257,10 +281,11 @@ namespace vme::db
              }()),
             ...);
 
-        status = sqlite3_step(statement);
+        int status = sqlite3_step(statement);
         if (status != SQLITE_DONE && status != SQLITE_ROW)
         {
-            sqlite3_finalize(statement);
+            sqlite3_reset(statement);
+            sqlite3_clear_bindings(statement);
             throw db_operation_error(std::format(
                 "Database operation error: {}", sqlite3_errmsg(db)));
         }
@@ -268,25 +293,40 @@ namespace vme::db
         return sql_result(statement, status == SQLITE_ROW);
     }
 
-    static void _put_audio(sqlite3* db, const api::vk_data::audio& audio)
+    // Inserts skip rows that already exist, so the change count tells
+    // whether the dependent rows still have to be written.
+    static bool _inserted(sqlite3* db) noexcept
+    {
+        return sqlite3_changes(db) != 0;
+    }
+
+    static void _finalize_statements(
+        std::unordered_map<const std::string*, sqlite3_stmt*>& statements)
     {
-        sql_result result =
-            _execute_stmt(db, sql::exists_audio, sql_int(audio.id));
-        if (result.get_bool(0))
+        for (const auto& [stmt, statement] : statements)
         {
-            return;
+            sqlite3_finalize(statement);
         }
 
-        _execute_stmt(db, sql::insert_audio, sql_int(audio.id),
-            sql_int(audio.owner_id), sql_text(audio.artist),
-            sql_text(audio.title), sql_int(audio.duration));
+        statements.clear();
     }
 
-    db::db(const std::string& db_file_path)
+    db::db(const std::string& db_file_path, std::size_t transaction_size,
+        std::chrono::milliseconds transaction_interval, bool keep_existing,
+        std::size_t write_queue_size) :
+        m_sqlite3(nullptr),
+        m_transaction_size(transaction_size),
+        m_transaction_interval(transaction_interval),
+        m_in_transaction(false),
+        m_transaction_open(false),
+        m_transaction_messages(0),
+        m_write_queue_size(write_queue_size),
+        m_writing(false),
+        m_writes_closed(false)
     {
         try
         {
-            if (std::filesystem::exists(db_file_path))
+            if (!keep_existing && std::filesystem::exists(db_file_path))
             {
                 if (!std::filesystem::is_regular_file(db_file_path))
                 {
@@ -324,358 +364,676 @@ namespace vme::db
                     db_file_path, message));
             sqlite3_free(message);
         }
+
+        if (m_write_queue_size != 0)
+        {
+            m_writer = std::thread(&db::writer, this);
+        }
     }
 
-    db::db(db&& other) noexcept :
-        m_sqlite3(other.m_sqlite3)
+    db::~db() noexcept
     {
-        other.m_sqlite3 = nullptr;
+        if (m_writer.joinable())
+        {
+            try
+            {
+                queue_messages();
+            }
+            catch (...)
+            {
+            }
+
+            {
+                std::lock_guard lock(m_write_mutex);
+                m_writes_closed = true;
+            }
+
+            m_write_cv.notify_all();
+            m_writer.join();
+        }
+
+        if (m_sqlite3 != nullptr)
+        {
+            // Whatever was written before a shutdown or an error is kept,
+            // a message that failed halfway has been rolled back.
+            if (m_in_transaction)
+            {
+                sqlite3_exec(m_sqlite3, sql::commit_transaction.c_str(),
+                    nullptr, nullptr, nullptr);
+            }
+
+            _finalize_statements(m_statements);
+            sqlite3_close_v2(m_sqlite3);
+        }
     }
 
-    db& db::operator=(db&& other) noexcept
+    void db::put(api::vk_data::message&& message)
     {
-        sqlite3_close_v2(m_sqlite3);
-        m_sqlite3 = other.m_sqlite3;
-        other.m_sqlite3 = nullptr;
+        track_write(1);
+
+        if (!m_writer.joinable())
+        {
+            std::lock_guard lock(m_sqlite_mutex);
+            begin();
+            store_message(message);
+            return;
+        }
 
-        return *this;
+        // Messages are handed to the writer in batches rather than as a
+        // write each.
+        m_queued_messages.push_back(std::move(message));
+        if (m_queued_messages.size() >= WRITE_BATCH_SIZE)
+        {
+            queue_messages();
+        }
     }
 
-    db::~db() noexcept
+    void db::put(const api::user_pool& user_pool)
     {
-        if (m_sqlite3 != nullptr)
+        track_write(0);
+        schedule(
+            [this, users = user_list(user_pool.begin(), user_pool.end()),
+                pending = std::vector<std::int64_t>(
+                    user_pool.pending().begin(), user_pool.pending().end())]
+            { insert_users(users, pending); });
+    }
+
+    // The result decides whether the media is queued for download, so
+    // the insert is not deferred to the writer.
+    bool db::put_media(const std::string& path, std::string_view url)
+    {
+        track_write(0);
+
+        std::lock_guard lock(m_sqlite_mutex);
+        begin();
+        _execute_stmt(m_sqlite3, prepare(sql::insert_media), sql_text(path),
+            sql_text(url));
+        if (_inserted(m_sqlite3))
         {
-            sqlite3_close_v2(m_sqlite3);
+            return true;
         }
+
+        // Signed media URLs expire, so media still queued from an earlier
+        // run takes the URL of the message fetched again.
+        _execute_stmt(m_sqlite3, prepare(sql::update_media_url),
+            sql_text(path), sql_text(url));
+        return false;
     }
 
-    void db::put(const api::vk_data::message& message)
+    void db::set_media_done(const std::string& path)
     {
-        sql_int id(sql_null);
-        if (message.id.has_value())
+        track_write(0);
+        schedule(
+            [this, path]
+            {
+                begin();
+                _execute_stmt(m_sqlite3, prepare(sql::update_media_done),
+                    sql_text(path));
+            });
+    }
+
+    std::vector<std::pair<std::string, std::string>> db::queued_media(
+        const std::string& after, std::size_t limit)
+    {
+        std::vector<std::pair<std::string, std::string>> media;
+        media.reserve(limit);
+
+        flush();
+        std::lock_guard lock(m_sqlite_mutex);
+        sql_result result = _execute_stmt(m_sqlite3,
+            prepare(sql::select_queued_media), sql_text(after), sql_int(limit));
+        while (result.is_row())
         {
-            id = sql_int(message.id.value());
+            media.emplace_back(result.get_text(0), result.get_text(1));
+            result.next();
+        }
+
+        return media;
+    }
+
+    std::size_t db::queued_media_count()
+    {
+        flush();
+        std::lock_guard lock(m_sqlite_mutex);
+        return _execute_stmt(m_sqlite3, prepare(sql::count_queued_media))
+            .get_int64(0);
+    }
+
+    std::vector<std::int64_t> db::user_ids()
+    {
+        return select_ids(sql::select_user_ids);
+    }
+
+    std::vector<std::int64_t> db::pending_users()
+    {
+        return select_ids(sql::select_pending_users);
+    }
+
+    sync_state db::load_sync_state(std::int64_t peer_id)
+    {
+        sync_state state = {};
+
+        flush();
+        std::lock_guard lock(m_sqlite_mutex);
+        sql_result result = _execute_stmt(
+            m_sqlite3, prepare(sql::select_sync_state), sql_int(peer_id));
+        if (result.is_row())
+        {
+            state.offset = result.get_int64(0);
+            state.last_conversation_message_id = result.get_int64(1);
+        }
+
+        state.next_link_id =
+            _execute_stmt(m_sqlite3, prepare(sql::select_next_link_id))
+                .get_int64(0);
+        state.next_call_id =
+            _execute_stmt(m_sqlite3, prepare(sql::select_next_call_id))
+                .get_int64(0);
+
+        return state;
+    }
+
+    void db::save_sync_state(std::int64_t peer_id, std::size_t offset,
+        std::int64_t last_conversation_message_id)
+    {
+        m_transaction_open = false;
+        schedule(
+            [this, peer_id, offset, last_conversation_message_id]
+            {
+                begin();
+                _execute_stmt(m_sqlite3, prepare(sql::upsert_sync_state),
+                    sql_int(peer_id), sql_int(offset),
+                    sql_int(last_conversation_message_id));
+                commit_transaction();
+            });
+    }
+
+    bool db::commit_due() const noexcept
+    {
+        return m_transaction_open &&
+               (m_transaction_messages >= m_transaction_size ||
+                   std::chrono::steady_clock::now() - m_transaction_start >=
+                       m_transaction_interval);
+    }
+
+    void db::commit()
+    {
+        m_transaction_open = false;
+        schedule([this] { commit_transaction(); });
+    }
+
+    void db::flush()
+    {
+        queue_messages();
+
+        std::unique_lock lock(m_write_mutex);
+        m_write_cv.wait(lock,
+            [this]
+            {
+                return (m_writes.empty() && !m_writing) || m_write_error;
+            });
+
+        if (m_write_error)
+        {
+            std::rethrow_exception(m_write_error);
+        }
+    }
+
+    void db::schedule(std::function<void()> write)
+    {
+        if (!m_writer.joinable())
+        {
+            std::lock_guard lock(m_sqlite_mutex);
+            write();
+            return;
+        }
+
+        // Messages put before the write are written before it.
+        queue_messages();
+        enqueue(std::move(write));
+    }
+
+    void db::queue_messages()
+    {
+        if (m_queued_messages.empty())
+        {
+            return;
+        }
+
+        // A queued write has to be copyable, so it shares the batch rather
+        // than holding a copy of it.
+        auto messages =
+            std::make_shared<const std::vector<api::vk_data::message>>(
+                std::move(m_queued_messages));
+        m_queued_messages.clear();
+
+        enqueue(
+            [this, messages]
+            {
+                begin();
+                for (const auto& message : *messages)
+                {
+                    store_message(message);
+                }
+            });
+    }
+
+    void db::enqueue(std::function<void()> write)
+    {
+        {
+            std::unique_lock lock(m_write_mutex);
+            m_write_cv.wait(lock,
+                [this]
+                {
+                    return m_writes.size() < m_write_queue_size ||
+                           m_write_error;
+                });
+
+            if (m_write_error)
+            {
+                std::rethrow_exception(m_write_error);
+            }
+
+            m_writes.push_back(std::move(write));
+        }
+
+        m_write_cv.notify_all();
+    }
+
+    void db::writer() noexcept
+    {
+        while (true)
+        {
+            std::function<void()> write;
+
+            {
+                std::unique_lock lock(m_write_mutex);
+                m_write_cv.wait(lock,
+                    [this] { return !m_writes.empty() || m_writes_closed; });
+
+                // Writes queued before shutdown are still done.
+                if (m_writes.empty())
+                {
+                    return;
+                }
+
+                write = std::move(m_writes.front());
+                m_writes.pop_front();
+                m_writing = true;
+            }
+
+            m_write_cv.notify_all();
+
+            std::exception_ptr error;
+            try
+            {
+                std::lock_guard lock(m_sqlite_mutex);
+                write();
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            {
+                std::lock_guard lock(m_write_mutex);
+                m_writing = false;
+
+                // Later writes may depend on the failed one, so they are
+                // dropped and the error is reported to the caller.
+                if (error)
+                {
+                    m_write_error = error;
+                    m_writes.clear();
+                }
+            }
+
+            m_write_cv.notify_all();
+
+            if (error)
+            {
+                return;
+            }
+        }
+    }
+
+    void db::track_write(std::size_t messages)
+    {
+        if (!m_transaction_open)
+        {
+            m_transaction_open = true;
+            m_transaction_messages = 0;
+            m_transaction_start = std::chrono::steady_clock::now();
         }
 
-        sql_result result = _execute_stmt(m_sqlite3, sql::exists_message, id,
-            sql_int(message.from_id), sql_int(message.conversation_message_id));
-        if (result.get_bool(0))
+        m_transaction_messages += messages;
+    }
+
+    void db::begin()
+    {
+        if (m_in_transaction)
         {
             return;
         }
 
+        _execute_stmt(m_sqlite3, prepare(sql::begin_transaction));
+        m_in_transaction = true;
+    }
+
+    void db::commit_transaction()
+    {
+        if (!m_in_transaction)
+        {
+            return;
+        }
+
+        _execute_stmt(m_sqlite3, prepare(sql::commit_transaction));
+        m_in_transaction = false;
+    }
+
+    std::vector<std::int64_t> db::select_ids(const std::string& stmt)
+    {
+        std::vector<std::int64_t> ids;
+
+        flush();
+        std::lock_guard lock(m_sqlite_mutex);
+        sql_result result = _execute_stmt(m_sqlite3, prepare(stmt));
+        while (result.is_row())
+        {
+            ids.push_back(result.get_int64(0));
+            result.next();
+        }
+
+        return ids;
+    }
+
+    sqlite3_stmt* db::prepare(const std::string& stmt)
+    {
+        auto it = m_statements.find(&stmt);
+        if (it != m_statements.end())
+        {
+            return it->second;
+        }
+
+        sqlite3_stmt* statement = nullptr;
+        int status = sqlite3_prepare_v2(
+            m_sqlite3, stmt.c_str(), -1, &statement, nullptr);
+        if (status != SQLITE_OK)
+        {
+            throw db_operation_error(std::format(
+                "Database operation error: {}", sqlite3_errmsg(m_sqlite3)));
+        }
+
+        m_statements.emplace(&stmt, statement);
+        return statement;
+    }
+
+    void db::insert_audio(const api::vk_data::audio& audio)
+    {
+        _execute_stmt(m_sqlite3, prepare(sql::insert_audio), sql_int(audio.id),
+            sql_int(audio.owner_id), sql_text(audio.artist),
+            sql_text(audio.title), sql_int(audio.duration));
+    }
+
+    void db::store_message(const api::vk_data::message& message)
+    {
+        // A partly inserted message would count as stored on the next
+        // incremental run, and the rest of it would never be written.
+        _execute_stmt(m_sqlite3, prepare(sql::savepoint_message));
+        try
+        {
+            insert_message(message);
+        }
+        catch (...)
+        {
+            sqlite3_exec(m_sqlite3, sql::rollback_message.c_str(), nullptr,
+                nullptr, nullptr);
+            throw;
+        }
+
+        _execute_stmt(m_sqlite3, prepare(sql::release_message));
+    }
+
+    void db::insert_message(const api::vk_data::message& message)
+    {
+        sql_int id(sql_null);
+        if (message.id.has_value())
+        {
+            id = sql_int(message.id.value());
+        }
+
         sql_int rcmi(sql_null);
         if (message.reply_conversation_message_id.has_value())
         {
             rcmi = sql_int(message.reply_conversation_message_id.value());
         }
 
-        _execute_stmt(m_sqlite3, sql::insert_message, id,
+        _execute_stmt(m_sqlite3, prepare(sql::insert_message), id,
             sql_int(message.from_id), sql_int(message.conversation_message_id),
             sql_int(message.date), sql_int(message.important),
             sql_text(message.text), rcmi, sql_text(message.original_json));
+        if (!_inserted(m_sqlite3))
+        {
+            return;
+        }
 
         std::int64_t attachment_index = 0;
         for (const auto& attachment : message.attachments)
         {
             std::int64_t attachment_id = 0;
 
-            switch (attachment.type)
+            switch (attachment.type())
             {
                 using enum api::vk_data::attachment_type;
             case photo:
             {
-                attachment_id = attachment.photo_value.id;
+                const auto& value =
+                    std::get<api::vk_data::photo>(attachment.value);
+                attachment_id = value.id;
 
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_photo, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
-
-                _execute_stmt(m_sqlite3, sql::insert_photo,
-                    sql_int(attachment.photo_value.id),
-                    sql_int(attachment.photo_value.owner_id),
-                    sql_int(attachment.photo_value.date));
+                _execute_stmt(m_sqlite3, prepare(sql::insert_photo),
+                    sql_int(value.id), sql_int(value.owner_id),
+                    sql_int(value.date));
                 break;
             }
 
             case video:
             {
-                attachment_id = attachment.video_value.id;
-
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_video, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
+                const auto& value =
+                    std::get<api::vk_data::video>(attachment.value);
+                attachment_id = value.id;
 
                 sql_text description(sql_null);
-                if (attachment.video_value.description.has_value())
+                if (value.description.has_value())
                 {
-                    description = attachment.video_value.description.value();
+                    description = sql_text(value.description.value());
                 }
 
-                _execute_stmt(m_sqlite3, sql::insert_video,
-                    sql_int(attachment.video_value.id),
-                    sql_int(attachment.video_value.owner_id),
-                    sql_int(attachment.video_value.date),
-                    sql_text(attachment.video_value.title), description);
+                _execute_stmt(m_sqlite3, prepare(sql::insert_video),
+                    sql_int(value.id), sql_int(value.owner_id),
+                    sql_int(value.date), sql_text(value.title), description);
                 break;
             }
 
             case audio:
             {
-                attachment_id = attachment.audio_value.id;
-                _put_audio(m_sqlite3, attachment.audio_value);
+                const auto& value =
+                    std::get<api::vk_data::audio>(attachment.value);
+                attachment_id = value.id;
+                insert_audio(value);
 
                 break;
             }
 
             case document:
             {
-                attachment_id = attachment.document_value.id;
-
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_document, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
-
-                _execute_stmt(m_sqlite3, sql::insert_document,
-                    sql_int(attachment.document_value.id),
-                    sql_int(attachment.document_value.owner_id),
-                    sql_int(attachment.document_value.date),
-                    sql_text(attachment.document_value.title),
-                    sql_text(attachment.document_value.ext));
+                const auto& value =
+                    std::get<api::vk_data::document>(attachment.value);
+                attachment_id = value.id;
+
+                _execute_stmt(m_sqlite3, prepare(sql::insert_document),
+                    sql_int(value.id), sql_int(value.owner_id),
+                    sql_int(value.date), sql_text(value.title),
+                    sql_text(value.ext));
                 break;
             }
 
             case link:
             {
-                attachment_id = attachment.link_value.id;
-
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_link, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
+                const auto& value =
+                    std::get<api::vk_data::link>(attachment.value);
+                attachment_id = value.id;
 
                 sql_text caption(sql_null);
-                if (attachment.link_value.caption.has_value())
+                if (value.caption.has_value())
                 {
-                    caption = attachment.link_value.caption.value();
+                    caption = sql_text(value.caption.value());
                 }
 
                 sql_text description(sql_null);
-                if (attachment.link_value.description.has_value())
+                if (value.description.has_value())
                 {
-                    description = attachment.link_value.description.value();
+                    description = sql_text(value.description.value());
                 }
 
-                _execute_stmt(m_sqlite3, sql::insert_link,
-                    sql_int(attachment.link_value.id),
-                    sql_text(attachment.link_value.title),
-                    sql_text(attachment.link_value.url), caption, description);
+                _execute_stmt(m_sqlite3, prepare(sql::insert_link),
+                    sql_int(value.id), sql_text(value.title),
+                    sql_text(value.url), caption, description);
                 break;
             }
 
             case product:
             {
-                attachment_id = attachment.product_value.id;
-
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_product, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
-
-                _execute_stmt(m_sqlite3, sql::insert_product,
-                    sql_int(attachment.product_value.id),
-                    sql_int(attachment.product_value.owner_id),
-                    sql_text(attachment.product_value.title),
-                    sql_text(attachment.product_value.description),
-                    sql_text(attachment.product_value.price),
-                    sql_text(attachment.product_value.currency),
-                    sql_text(attachment.product_value.category_name),
-                    sql_text(attachment.product_value.category_section));
+                const auto& value =
+                    std::get<api::vk_data::product>(attachment.value);
+                attachment_id = value.id;
+
+                _execute_stmt(m_sqlite3, prepare(sql::insert_product),
+                    sql_int(value.id), sql_int(value.owner_id),
+                    sql_text(value.title), sql_text(value.description),
+                    sql_text(value.price), sql_text(value.currency),
+                    sql_text(value.category_name),
+                    sql_text(value.category_section));
                 break;
             }
 
             case product_album:
             {
-                attachment_id = attachment.product_album_value.id;
-
-                sql_result result = _execute_stmt(m_sqlite3,
-                    sql::exists_product_album, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
-
-                _execute_stmt(m_sqlite3, sql::insert_product_album,
-                    sql_int(attachment.product_album_value.id),
-                    sql_int(attachment.product_album_value.owner_id),
-                    sql_text(attachment.product_album_value.title),
-                    sql_int(attachment.product_album_value.is_main),
-                    sql_int(attachment.product_album_value.is_hidden));
+                const auto& value =
+                    std::get<api::vk_data::product_album>(attachment.value);
+                attachment_id = value.id;
+
+                _execute_stmt(m_sqlite3, prepare(sql::insert_product_album),
+                    sql_int(value.id), sql_int(value.owner_id),
+                    sql_text(value.title), sql_int(value.is_main),
+                    sql_int(value.is_hidden));
                 break;
             }
 
             case post:
             {
-                attachment_id = attachment.post_value.id;
-
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_post, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
-
-                _execute_stmt(m_sqlite3, sql::insert_post,
-                    sql_int(attachment.post_value.id),
-                    sql_int(attachment.post_value.owner_id),
-                    sql_int(attachment.post_value.from_id),
-                    sql_int(attachment.post_value.date),
-                    sql_text(attachment.post_value.text));
+                const auto& value =
+                    std::get<api::vk_data::post>(attachment.value);
+                attachment_id = value.id;
+
+                _execute_stmt(m_sqlite3, prepare(sql::insert_post),
+                    sql_int(value.id), sql_int(value.owner_id),
+                    sql_int(value.from_id), sql_int(value.date),
+                    sql_text(value.text));
                 break;
             }
 
             case comment:
             {
-                attachment_id = attachment.comment_value.id;
-
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_comment, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
+                const auto& value =
+                    std::get<api::vk_data::comment>(attachment.value);
+                attachment_id = value.id;
 
-                _execute_stmt(m_sqlite3, sql::insert_comment,
-                    sql_int(attachment.comment_value.id),
-                    sql_int(attachment.comment_value.from_id),
-                    sql_int(attachment.comment_value.date),
-                    sql_text(attachment.comment_value.text));
+                _execute_stmt(m_sqlite3, prepare(sql::insert_comment),
+                    sql_int(value.id), sql_int(value.from_id),
+                    sql_int(value.date), sql_text(value.text));
                 break;
             }
 
             case sticker:
             {
-                attachment_id = attachment.sticker_value.id;
+                const auto& value =
+                    std::get<api::vk_data::sticker>(attachment.value);
+                attachment_id = value.id;
 
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_sticker, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
-
-                _execute_stmt(m_sqlite3, sql::insert_sticker,
-                    sql_int(attachment.sticker_value.id));
+                _execute_stmt(m_sqlite3, prepare(sql::insert_sticker),
+                    sql_int(value.id));
                 break;
             }
 
             case gift:
             {
-                attachment_id = attachment.gift_value.id;
+                const auto& value =
+                    std::get<api::vk_data::gift>(attachment.value);
+                attachment_id = value.id;
 
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_gift, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
-
-                _execute_stmt(m_sqlite3, sql::insert_gift,
-                    sql_int(attachment.gift_value.id));
+                _execute_stmt(m_sqlite3, prepare(sql::insert_gift),
+                    sql_int(value.id));
                 break;
             }
 
             case call:
             {
-                attachment_id = attachment.call_value.id;
-
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_call, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
-
-                _execute_stmt(m_sqlite3, sql::insert_call,
-                    sql_int(attachment.call_value.id),
-                    sql_int(attachment.call_value.initiator_id),
-                    sql_int(attachment.call_value.receiver_id),
-                    sql_text(attachment.call_value.state),
-                    sql_int(attachment.call_value.time),
-                    sql_int(attachment.call_value.duration),
-                    sql_int(attachment.call_value.video));
+                const auto& value =
+                    std::get<api::vk_data::call>(attachment.value);
+                attachment_id = value.id;
+
+                _execute_stmt(m_sqlite3, prepare(sql::insert_call),
+                    sql_int(value.id), sql_int(value.initiator_id),
+                    sql_int(value.receiver_id), sql_text(value.state),
+                    sql_int(value.time), sql_int(value.duration),
+                    sql_int(value.video));
                 break;
             }
 
             case audio_message:
             {
-                attachment_id = attachment.audio_message_value.id;
-
-                sql_result result = _execute_stmt(m_sqlite3,
-                    sql::exists_audio_message, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
+                const auto& value =
+                    std::get<api::vk_data::audio_message>(attachment.value);
+                attachment_id = value.id;
 
-                const std::uint16_t* data =
-                    attachment.audio_message_value.waveform.data();
-                std::size_t len =
-                    attachment.audio_message_value.waveform.size() *
-                    sizeof(std::int16_t);
+                const std::uint16_t* data = value.waveform.data();
+                std::size_t len = value.waveform.size() * sizeof(std::int16_t);
                 sql_blob waveform(
                     reinterpret_cast<const unsigned char*>(data), len);
 
-                _execute_stmt(m_sqlite3, sql::insert_audio_message,
-                    sql_int(attachment.audio_message_value.id),
-                    sql_int(attachment.audio_message_value.owner_id),
-                    sql_int(attachment.audio_message_value.duration), waveform);
+                _execute_stmt(m_sqlite3, prepare(sql::insert_audio_message),
+                    sql_int(value.id), sql_int(value.owner_id),
+                    sql_int(value.duration), waveform);
                 break;
             }
 
             case audio_playlist:
             {
-                attachment_id = attachment.audio_playlist_value.id;
+                const auto& value =
+                    std::get<api::vk_data::audio_playlist>(attachment.value);
+                attachment_id = value.id;
 
-                sql_result result = _execute_stmt(m_sqlite3,
-                    sql::exists_audio_playlist, sql_int(attachment_id));
-                if (result.get_bool(0))
+                sql_int year(sql_null);
+                if (value.year.has_value())
                 {
-                    break;
+                    year = sql_int(value.year.value());
                 }
 
-                sql_int year(sql_null);
-                if (attachment.audio_playlist_value.year.has_value())
+                _execute_stmt(m_sqlite3, prepare(sql::insert_audio_playlist),
+                    sql_int(value.id), sql_int(value.owner_id),
+                    sql_int(value.create_time), sql_int(value.update_time),
+                    year, sql_text(value.title), sql_text(value.description));
+                if (!_inserted(m_sqlite3))
                 {
-                    year =
-                        sql_int(attachment.audio_playlist_value.year.value());
+                    break;
                 }
 
-                _execute_stmt(m_sqlite3, sql::insert_audio_playlist,
-                    sql_int(attachment.audio_playlist_value.id),
-                    sql_int(attachment.audio_playlist_value.owner_id),
-                    sql_int(attachment.audio_playlist_value.create_time),
-                    sql_int(attachment.audio_playlist_value.update_time), year,
-                    sql_text(attachment.audio_playlist_value.title),
-                    sql_text(attachment.audio_playlist_value.description));
-
-                for (const auto& audio : attachment.audio_playlist_value.audios)
+                for (const auto& audio : value.audios)
                 {
-                    _put_audio(m_sqlite3, audio);
-                    _execute_stmt(m_sqlite3, sql::insert_audio_playlist_audio,
+                    insert_audio(audio);
+                    _execute_stmt(m_sqlite3,
+                        prepare(sql::insert_audio_playlist_audio),
                         sql_int(audio.id), sql_int(attachment_id));
                 }
                 break;
@@ -683,90 +1041,60 @@ namespace vme::db
 
             case graffiti:
             {
-                attachment_id = attachment.graffiti_value.id;
+                const auto& value =
+                    std::get<api::vk_data::graffiti>(attachment.value);
+                attachment_id = value.id;
 
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_graffiti, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
-
-                _execute_stmt(m_sqlite3, sql::insert_graffiti,
-                    sql_int(attachment.graffiti_value.id),
-                    sql_int(attachment.graffiti_value.owner_id));
+                _execute_stmt(m_sqlite3, prepare(sql::insert_graffiti),
+                    sql_int(value.id), sql_int(value.owner_id));
 
                 break;
             }
 
             case money_request:
             {
-                attachment_id = attachment.money_request_value.id;
-
-                sql_result result = _execute_stmt(m_sqlite3,
-                    sql::exists_money_request, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
+                const auto& value =
+                    std::get<api::vk_data::money_request>(attachment.value);
+                attachment_id = value.id;
 
-                _execute_stmt(m_sqlite3, sql::insert_money_request,
-                    sql_int(attachment.money_request_value.id),
-                    sql_int(attachment.money_request_value.from_id),
-                    sql_int(attachment.money_request_value.to_id),
-                    sql_text(attachment.money_request_value.amount),
-                    sql_text(attachment.money_request_value.currency));
+                _execute_stmt(m_sqlite3, prepare(sql::insert_money_request),
+                    sql_int(value.id), sql_int(value.from_id),
+                    sql_int(value.to_id), sql_text(value.amount),
+                    sql_text(value.currency));
 
                 break;
             }
 
             case story:
             {
-                attachment_id = attachment.story_value.id;
-
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_story, sql_int(attachment_id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
+                const auto& value =
+                    std::get<api::vk_data::story>(attachment.value);
+                attachment_id = value.id;
 
-                _execute_stmt(m_sqlite3, sql::insert_story,
-                    sql_int(attachment.story_value.id),
-                    sql_int(attachment.story_value.owner_id),
-                    sql_int(attachment.story_value.date),
-                    sql_int(attachment.story_value.expires_at));
+                _execute_stmt(m_sqlite3, prepare(sql::insert_story),
+                    sql_int(value.id), sql_int(value.owner_id),
+                    sql_int(value.date), sql_int(value.expires_at));
 
                 break;
             }
 
             case poll:
             {
-                attachment_id = attachment.poll_value.id;
-                sql_result result = _execute_stmt(
-                    m_sqlite3, sql::exists_poll, sql_int(attachment_id));
-                if (result.get_bool(0))
+                const auto& value =
+                    std::get<api::vk_data::poll>(attachment.value);
+                attachment_id = value.id;
+
+                _execute_stmt(m_sqlite3, prepare(sql::insert_poll),
+                    sql_int(value.id), sql_int(value.owner_id),
+                    sql_text(value.question), sql_int(value.votes));
+                if (!_inserted(m_sqlite3))
                 {
                     break;
                 }
 
-                _execute_stmt(m_sqlite3, sql::insert_poll,
-                    sql_int(attachment.poll_value.id),
-                    sql_int(attachment.poll_value.owner_id),
-                    sql_text(attachment.poll_value.question),
-                    sql_int(attachment.poll_value.votes));
-
-                for (const auto& answer : attachment.poll_value.answers)
+                for (const auto& answer : value.answers)
                 {
-                    sql_result result =
-                        _execute_stmt(m_sqlite3, sql::exists_poll_answer,
-                            sql_int(answer.id), sql_int(attachment_id));
-                    if (result.get_bool(0))
-                    {
-                        continue;
-                    }
-
-                    _execute_stmt(m_sqlite3, sql::insert_poll_answer,
+                    _execute_stmt(m_sqlite3, prepare(sql::insert_poll_answer),
                         sql_int(answer.id), sql_int(attachment_id),
                         sql_real(answer.rate), sql_text(answer.text),
                         sql_int(answer.votes));
@@ -777,30 +1105,23 @@ namespace vme::db
 
             case event:
             {
-                attachment_id = attachment.event_value.id;
-                sql_result result = _execute_stmt(m_sqlite3, sql::exists_event,
-                    sql_int(attachment.event_value.id));
-                if (result.get_bool(0))
-                {
-                    break;
-                }
-
-                _execute_stmt(m_sqlite3, sql::insert_event,
-                    sql_int(attachment.event_value.id),
-                    sql_text(attachment.event_value.button_text),
-                    sql_text(attachment.event_value.text),
-                    sql_int(attachment.event_value.member_status));
+                const auto& value =
+                    std::get<api::vk_data::event>(attachment.value);
+                attachment_id = value.id;
+                _execute_stmt(m_sqlite3, prepare(sql::insert_event),
+                    sql_int(value.id), sql_text(value.button_text),
+                    sql_text(value.text), sql_int(value.member_status));
 
                 break;
             }
             }
 
-            _execute_stmt(m_sqlite3, sql::insert_message_attachment,
+            _execute_stmt(m_sqlite3, prepare(sql::insert_message_attachment),
                 sql_int(message.from_id),
                 sql_int(message.conversation_message_id),
                 sql_int(attachment_index), sql_int(attachment_id),
-                sql_text(
-                    api::vk_data::attachment_type_to_string(attachment.type)));
+                sql_text(api::vk_data::attachment_type_to_string(
+                    attachment.type())));
 
             attachment_index++;
         }
@@ -808,32 +1129,35 @@ namespace vme::db
         std::int64_t fwd_message_index = 0;
         for (const auto& fwd_message : message.fwd_messages)
         {
-            _execute_stmt(m_sqlite3, sql::insert_forwarded_message,
+            _execute_stmt(m_sqlite3, prepare(sql::insert_forwarded_message),
                 sql_int(message.from_id),
                 sql_int(message.conversation_message_id),
-                sql_int(fwd_message->from_id),
-                sql_int(fwd_message->conversation_message_id),
+                sql_int(fwd_message.from_id),
+                sql_int(fwd_message.conversation_message_id),
                 sql_int(fwd_message_index));
 
-            put(*fwd_message.get());
+            insert_message(fwd_message);
             fwd_message_index++;
         }
     }
 
-    void db::put(const api::user_pool& user_pool)
+    void db::insert_users(const user_list& users,
+        const std::vector<std::int64_t>& pending_users)
     {
-        for (const auto& [id, user] : user_pool)
-        {
-            sql_result result =
-                _execute_stmt(m_sqlite3, sql::exists_user, sql_int(id));
-            if (result.get_bool(0))
-            {
-                continue;
-            }
+        begin();
 
-            _execute_stmt(m_sqlite3, sql::insert_user, sql_int(id),
+        for (const auto& [id, user] : users)
+        {
+            _execute_stmt(m_sqlite3, prepare(sql::insert_user), sql_int(id),
                 sql_text(user.first_name), sql_text(user.last_name));
         }
+
+        _execute_stmt(m_sqlite3, prepare(sql::delete_pending_users));
+        for (auto id : pending_users)
+        {
+            _execute_stmt(
+                m_sqlite3, prepare(sql::insert_pending_user), sql_int(id));
+        }
     }
 
 }
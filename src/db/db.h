@@ -1,6 +1,19 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+#include <utility>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
 
 #include "error.h"
 #include "api/vk_data.h"
@@ -8,6 +21,8 @@
 
 struct sqlite3;
 typedef struct sqlite3 sqlite3;
+struct sqlite3_stmt;
+typedef struct sqlite3_stmt sqlite3_stmt;
 
 namespace vme::db
 {
@@ -30,27 +45,128 @@ namespace vme::db
         }
     };
 
+    // Where an incremental export of a peer continues from.
+    struct sync_state
+    {
+        std::size_t offset;
+        std::int64_t last_conversation_message_id;
+        std::int64_t next_link_id;
+        std::int64_t next_call_id;
+    };
+
     class db
     {
     public:
-        db(const std::string& db_file_path);
+        // With a non-zero write_queue_size, writes are queued for a writer
+        // thread and the caller blocks only while the queue is full.
+        db(const std::string& db_file_path, std::size_t transaction_size,
+            std::chrono::milliseconds transaction_interval, bool keep_existing,
+            std::size_t write_queue_size);
 
         db(const db& other) = delete;
 
-        db(db&& other) noexcept;
-
         db& operator=(const db& other) = delete;
 
-        db& operator=(db&& other) noexcept;
-
         ~db() noexcept;
 
-        void put(const api::vk_data::message& message);
+        void put(api::vk_data::message&& message);
 
+        // Stores resolved users and replaces the saved pending user ids.
         void put(const api::user_pool& user_pool);
 
+        // Returns false when the media is already queued or downloaded.
+        bool put_media(const std::string& path, std::string_view url);
+
+        void set_media_done(const std::string& path);
+
+        // Pages through queued media in path order, starting after
+        // the given path.
+        std::vector<std::pair<std::string, std::string>> queued_media(
+            const std::string& after, std::size_t limit);
+
+        std::size_t queued_media_count();
+
+        std::vector<std::int64_t> user_ids();
+
+        std::vector<std::int64_t> pending_users();
+
+        sync_state load_sync_state(std::int64_t peer_id);
+
+        // Writes the checkpoint and commits it together with everything
+        // stored since the previous one.
+        void save_sync_state(std::int64_t peer_id, std::size_t offset,
+            std::int64_t last_conversation_message_id);
+
+        bool commit_due() const noexcept;
+
+        void commit();
+
+        // Waits for queued writes and rethrows the error of a failed one.
+        void flush();
+
     private:
+        static constexpr std::size_t WRITE_BATCH_SIZE = 50;
+
+        using user_list =
+            std::vector<std::pair<std::int64_t, api::vk_data::user>>;
+
+        // Runs a write on the writer thread, in order with the other
+        // writes, or right away when there is no writer.
+        void schedule(std::function<void()> write);
+
+        // Hands the messages put so far to the writer as one write.
+        void queue_messages();
+
+        void enqueue(std::function<void()> write);
+
+        void writer() noexcept;
+
+        // Accounts a write in the transaction commit_due() reports on.
+        void track_write(std::size_t messages);
+
+        void begin();
+
+        void commit_transaction();
+
+        void insert_users(const user_list& users,
+            const std::vector<std::int64_t>& pending_users);
+
+        // Inserts a message with its attachments and forwarded messages as
+        // a whole, a failed insert leaves none of its rows behind.
+        void store_message(const api::vk_data::message& message);
+
+        void insert_message(const api::vk_data::message& message);
+
+        void insert_audio(const api::vk_data::audio& audio);
+
+        std::vector<std::int64_t> select_ids(const std::string& stmt);
+
+        // Statements are keyed by the address of their sql:: constant.
+        sqlite3_stmt* prepare(const std::string& stmt);
+
         sqlite3* m_sqlite3;
+        std::size_t m_transaction_size;
+        std::chrono::milliseconds m_transaction_interval;
+        std::unordered_map<const std::string*, sqlite3_stmt*> m_statements;
+
+        // Guards the connection, the writer holds it while writing.
+        std::mutex m_sqlite_mutex;
+        bool m_in_transaction;
+
+        // Transaction as seen by the caller, the writer may lag behind.
+        bool m_transaction_open;
+        std::size_t m_transaction_messages;
+        std::chrono::steady_clock::time_point m_transaction_start;
+
+        std::size_t m_write_queue_size;
+        std::mutex m_write_mutex;
+        std::condition_variable m_write_cv;
+        std::deque<std::function<void()>> m_writes;
+        std::vector<api::vk_data::message> m_queued_messages;
+        bool m_writing;
+        bool m_writes_closed;
+        std::exception_ptr m_write_error;
+        std::thread m_writer;
     };
 
 }
@@ -25,13 +25,10 @@ CREATE TABLE IF NOT EXISTS forwarded_messages (
     message_conversation_message_id INTEGER NOT NULL,
     forwarded_from_id INTEGER NOT NULL,
     forwarded_conversation_message_id INTEGER NOT NULL,
-    sequence_number INTEGER NOT NULL
+    sequence_number INTEGER NOT NULL,
+    UNIQUE (message_from_id, message_conversation_message_id, sequence_number)
 );
 
-CREATE INDEX IF NOT EXISTS
-    idx_forwarded_messages_message_from_id_message_conversation_message_id
-    ON forwarded_messages(message_from_id, message_conversation_message_id);
-
 CREATE TABLE IF NOT EXISTS users (
     id INTEGER NOT NULL PRIMARY KEY,
     first_name TEXT NOT NULL,
@@ -147,7 +144,8 @@ CREATE TABLE IF NOT EXISTS audio_playlists (
 
 CREATE TABLE IF NOT EXISTS audio_playlist_audios (
     audio_id INTEGER NOT NULL,
-    audio_playlist_id INTEGER NOT NULL
+    audio_playlist_id INTEGER NOT NULL,
+    UNIQUE (audio_id, audio_playlist_id)
 );
 
 CREATE TABLE IF NOT EXISTS polls (
@@ -166,9 +164,6 @@ CREATE TABLE IF NOT EXISTS poll_answers (
     PRIMARY KEY (id, poll_id)
 );
 
-CREATE INDEX IF NOT EXISTS idx_audio_playlist_audios_audio_id_audio_playlist_id
-    ON audio_playlist_audios(audio_id, audio_playlist_id);
-
 CREATE TABLE IF NOT EXISTS graffitis (
     id INTEGER NOT NULL PRIMARY KEY,
     owner_id INTEGER NOT NULL
@@ -201,241 +196,269 @@ CREATE TABLE IF NOT EXISTS message_attachments (
     message_conversation_message_id INTEGER NOT NULL,
     sequence_number INTEGER NOT NULL,
     attachment_id INTEGER NOT NULL,
-    attachment_type TEXT NOT NULL
+    attachment_type TEXT NOT NULL,
+    UNIQUE (message_from_id, message_conversation_message_id, sequence_number)
+);
+
+CREATE TABLE IF NOT EXISTS sync_state (
+    peer_id INTEGER NOT NULL PRIMARY KEY,
+    message_offset INTEGER NOT NULL,
+    last_conversation_message_id INTEGER NOT NULL
+);
+
+CREATE TABLE IF NOT EXISTS pending_users (
+    id INTEGER NOT NULL PRIMARY KEY
+);
+
+CREATE TABLE IF NOT EXISTS media_queue (
+    path TEXT NOT NULL PRIMARY KEY,
+    url TEXT NOT NULL,
+    status TEXT NOT NULL
 );
+)"""";
+
+    static inline const std::string begin_transaction = R""""(
+BEGIN;
+)"""";
+
+    static inline const std::string commit_transaction = R""""(
+COMMIT;
+)"""";
+
+    static inline const std::string savepoint_message = R""""(
+SAVEPOINT message;
+)"""";
+
+    static inline const std::string release_message = R""""(
+RELEASE message;
+)"""";
+
+    static inline const std::string rollback_message = R""""(
+ROLLBACK TO message;
+RELEASE message;
+)"""";
+
+    static inline const std::string select_sync_state = R""""(
+SELECT message_offset, last_conversation_message_id FROM sync_state
+WHERE peer_id = ?1;
+)"""";
+
+    static inline const std::string upsert_sync_state = R""""(
+INSERT INTO sync_state (peer_id, message_offset, last_conversation_message_id)
+VALUES (?1, ?2, ?3)
+ON CONFLICT (peer_id) DO UPDATE SET message_offset = excluded.message_offset,
+last_conversation_message_id = excluded.last_conversation_message_id;
+)"""";
+
+    static inline const std::string select_next_link_id = R""""(
+SELECT IFNULL(MAX(id) + 1, 0) FROM links;
+)"""";
+
+    static inline const std::string select_next_call_id = R""""(
+SELECT IFNULL(MAX(id) + 1, 0) FROM calls;
+)"""";
+
+    static inline const std::string select_user_ids = R""""(
+SELECT id FROM users;
+)"""";
+
+    static inline const std::string select_pending_users = R""""(
+SELECT id FROM pending_users;
+)"""";
+
+    static inline const std::string delete_pending_users = R""""(
+DELETE FROM pending_users;
+)"""";
+
+    static inline const std::string insert_pending_user = R""""(
+INSERT INTO pending_users (id)
+VALUES (?1)
+ON CONFLICT DO NOTHING;
+)"""";
+
+    static inline const std::string insert_media = R""""(
+INSERT INTO media_queue (path, url, status)
+VALUES (?1, ?2, 'queued')
+ON CONFLICT DO NOTHING;
+)"""";
+
+    static inline const std::string update_media_url = R""""(
+UPDATE media_queue SET url = ?2
+WHERE path = ?1 AND status = 'queued';
+)"""";
+
+    static inline const std::string update_media_done = R""""(
+UPDATE media_queue SET status = 'done' WHERE path = ?1;
+)"""";
 
-CREATE INDEX IF NOT EXISTS
-    idx_message_attachments_message_from_id_message_conversation_message_id
-    ON message_attachments(message_from_id, message_conversation_message_id);
+    static inline const std::string select_queued_media = R""""(
+SELECT path, url FROM media_queue
+WHERE status = 'queued' AND path > ?1
+ORDER BY path
+LIMIT ?2;
 )"""";
 
-    static inline const std::string exists_message = R""""(
-SELECT EXISTS (SELECT * FROM messages
-               WHERE id = ?1 AND from_id = ?2
-               AND conversation_message_id = ?3);
+    static inline const std::string count_queued_media = R""""(
+SELECT COUNT(*) FROM media_queue WHERE status = 'queued';
 )"""";
 
     static inline const std::string insert_message = R""""(
 INSERT INTO messages
 (id, from_id, conversation_message_id, date, important, text,
 reply_conversation_message_id, original_json)
-VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8);
+VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_forwarded_message = R""""(
 INSERT INTO forwarded_messages
 (message_from_id, message_conversation_message_id, forwarded_from_id,
 forwarded_conversation_message_id, sequence_number)
-VALUES (?1, ?2, ?3, ?4, ?5);
+VALUES (?1, ?2, ?3, ?4, ?5)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_user = R""""(
 INSERT INTO users (id, first_name, last_name)
-VALUES (?1, ?2, ?3);
-)"""";
-
-    static inline const std::string exists_user = R""""(
-SELECT EXISTS (SELECT * FROM users WHERE id = ?1);
+VALUES (?1, ?2, ?3)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_photo = R""""(
 INSERT INTO photos (id, owner_id, date)
-VALUES (?1, ?2, ?3);
-)"""";
-
-    static inline const std::string exists_photo = R""""(
-SELECT EXISTS (SELECT * FROM photos WHERE id = ?1);
+VALUES (?1, ?2, ?3)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_video = R""""(
 INSERT INTO videos (id, owner_id, date, title, description)
-VALUES (?1, ?2, ?3, ?4, ?5);
-)"""";
-
-    static inline const std::string exists_video = R""""(
-SELECT EXISTS (SELECT * FROM videos WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4, ?5)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_audio = R""""(
 INSERT INTO audios (id, owner_id, artist, title, duration)
-VALUES (?1, ?2, ?3, ?4, ?5);
-)"""";
-
-    static inline const std::string exists_audio = R""""(
-SELECT EXISTS (SELECT * FROM audios WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4, ?5)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_document = R""""(
 INSERT INTO documents (id, owner_id, date, title, ext)
-VALUES (?1, ?2, ?3, ?4, ?5);
-)"""";
-
-    static inline const std::string exists_document = R""""(
-SELECT EXISTS (SELECT * FROM documents WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4, ?5)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_link = R""""(
 INSERT INTO links (id, url, title, caption, description)
-VALUES (?1, ?2, ?3, ?4, ?5);
-)"""";
-
-    static inline const std::string exists_link = R""""(
-SELECT EXISTS (SELECT * FROM links WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4, ?5)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_product = R""""(
 INSERT INTO products (id, owner_id, title, description, price, currency,
 category_name, category_section)
-VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8);
-)"""";
-
-    static inline const std::string exists_product = R""""(
-SELECT EXISTS (SELECT * FROM products WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_product_album = R""""(
 INSERT INTO product_albums (id, owner_id, title, is_main, is_hidden)
-VALUES (?1, ?2, ?3, ?4, ?5);
-)"""";
-
-    static inline const std::string exists_product_album = R""""(
-SELECT EXISTS (SELECT * FROM product_albums WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4, ?5)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_post = R""""(
 INSERT INTO posts (id, owner_id, from_id, date, text)
-VALUES (?1, ?2, ?3, ?4, ?5);
-)"""";
-
-    static inline const std::string exists_post = R""""(
-SELECT EXISTS (SELECT * FROM posts WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4, ?5)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_comment = R""""(
 INSERT INTO comments (id, from_id, date, text)
-VALUES (?1, ?2, ?3, ?4);
-)"""";
-
-    static inline const std::string exists_comment = R""""(
-SELECT EXISTS (SELECT * FROM comments WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_sticker = R""""(
 INSERT INTO stickers (id)
-VALUES (?1);
-)"""";
-
-    static inline const std::string exists_sticker = R""""(
-SELECT EXISTS (SELECT * FROM stickers WHERE id = ?1);
+VALUES (?1)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_gift = R""""(
 INSERT INTO gifts (id)
-VALUES (?1);
-)"""";
-
-    static inline const std::string exists_gift = R""""(
-SELECT EXISTS (SELECT * FROM gifts WHERE id = ?1);
+VALUES (?1)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_call = R""""(
 INSERT INTO calls (id, initiator_id, receiver_id, state, time, duration,
 video)
-VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7);
-)"""";
-
-    static inline const std::string exists_call = R""""(
-SELECT EXISTS (SELECT * FROM calls WHERE id = ?1);
-)"""";
-
-    static inline const std::string exists_audio_message = R""""(
-SELECT EXISTS (SELECT * FROM audio_messages WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_audio_message = R""""(
 INSERT INTO audio_messages (id, owner_id, duration, waveform)
-VALUES (?1, ?2, ?3, ?4);
-)"""";
-
-    static inline const std::string exists_audio_playlist = R""""(
-SELECT EXISTS (SELECT * FROM audio_playlists WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_audio_playlist = R""""(
 INSERT INTO audio_playlists (id, owner_id, create_time, update_time, year,
 title, description)
-VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7);
-)"""";
-
-    static inline const std::string exists_audio_playlist_audio = R""""(
-SELECT EXISTS (SELECT * FROM audio_playlist_audios WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_audio_playlist_audio = R""""(
 INSERT INTO audio_playlist_audios (audio_id, audio_playlist_id)
-VALUES (?1, ?2);
-)"""";
-
-    static inline const std::string exists_graffiti = R""""(
-SELECT EXISTS (SELECT * FROM graffitis WHERE id = ?1);
+VALUES (?1, ?2)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_graffiti = R""""(
 INSERT INTO graffitis (id, owner_id)
-VALUES (?1, ?2);
-)"""";
-
-    static inline const std::string exists_money_request = R""""(
-SELECT EXISTS (SELECT * FROM money_requests WHERE id = ?1);
+VALUES (?1, ?2)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_money_request = R""""(
 INSERT INTO money_requests (id, from_id, to_id, amount, currency)
-VALUES (?1, ?2, ?3, ?4, ?5);
-)"""";
-
-    static inline const std::string exists_story = R""""(
-SELECT EXISTS (SELECT * FROM stories WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4, ?5)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_story = R""""(
 INSERT INTO stories (id, owner_id, date, expires_at)
-VALUES (?1, ?2, ?3, ?4);
+VALUES (?1, ?2, ?3, ?4)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_poll = R""""(
 INSERT INTO polls (id, owner_id, question, votes)
-VALUES (?1, ?2, ?3, ?4);
-)"""";
-
-    static inline const std::string exists_poll = R""""(
-SELECT EXISTS (SELECT * FROM polls WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_poll_answer = R""""(
 INSERT INTO poll_answers (id, poll_id, rate, text, votes)
-VALUES (?1, ?2, ?3, ?4, ?5);
-)"""";
-
-    static inline const std::string exists_poll_answer = R""""(
-SELECT EXISTS (SELECT * FROM poll_answers
-    WHERE id = ?1 AND poll_id = ?2);
+VALUES (?1, ?2, ?3, ?4, ?5)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_event = R""""(
 INSERT INTO events (id, button_text, text, member_status)
-VALUES (?1, ?2, ?3, ?4);
-)"""";
-
-    static inline const std::string exists_event = R""""(
-SELECT EXISTS (SELECT * FROM events WHERE id = ?1);
+VALUES (?1, ?2, ?3, ?4)
+ON CONFLICT DO NOTHING;
 )"""";
 
     static inline const std::string insert_message_attachment = R""""(
 INSERT INTO message_attachments (message_from_id,
 message_conversation_message_id, sequence_number, attachment_id,
 attachment_type)
-VALUES (?1, ?2, ?3, ?4, ?5);
+VALUES (?1, ?2, ?3, ?4, ?5)
+ON CONFLICT DO NOTHING;
 )"""";
 
 }
@@ -1,23 +1,15 @@
 #include "storage.h"
 
 #include <iostream>
-#include <fstream>
 #include <format>
 #include <filesystem>
+#include <utility>
 
 #include "curl.h"
 
 namespace vme::db
 {
 
-    static std::ofstream _open_ofstream(const std::string& path)
-    {
-        std::ofstream result;
-        result.exceptions(std::ios::badbit | std::ios::failbit);
-        result.open(path, std::ios::trunc | std::ios::binary);
-        return result;
-    }
-
     static void _show_downloading(
         const std::string& what, bool show_progress) noexcept
     {
@@ -69,182 +61,181 @@ namespace vme::db
         }
     }
 
-    storage::storage(const std::string& root, db& database) :
+    storage::storage(const std::string& root, db& database,
+        std::size_t max_downloads, std::size_t host_downloads,
+        bool stream_media, bool skip_existing) :
         m_root(root),
-        m_db(database)
+        m_db(database),
+        m_max_downloads(max_downloads),
+        m_stream_media(stream_media),
+        m_skip_existing(skip_existing),
+        m_multi(max_downloads, host_downloads),
+        m_enqueued(0),
+        m_downloaded(0),
+        m_download_closed(false),
+        m_download_aborted(false),
+        m_download_finished(false)
     {
+        if (m_stream_media)
+        {
+            create_directories();
+            m_download_thread = std::thread(&storage::download_worker, this);
+        }
     }
 
-    void storage::put(const api::vk_data::message& message)
+    storage::~storage() noexcept
     {
-        pull_links(message);
-        m_db.put(message);
+        if (m_download_thread.joinable())
+        {
+            {
+                std::lock_guard lock(m_download_mutex);
+                m_download_closed = true;
+                m_download_aborted = true;
+            }
+
+            m_download_cv.notify_all();
+            m_download_thread.join();
+        }
     }
 
-    void storage::download_media(bool show_progress) const
+    void storage::put(api::vk_data::message&& message)
     {
-        try
+        if (m_stream_media)
         {
-            std::size_t count = 0;
-            std::size_t total = m_photos.size();
-            _show_downloading("photos", show_progress);
-            _create_directory(m_root, "photos");
-            for (const auto& [id, url] : m_photos)
             {
-                std::ofstream ofstream =
-                    _open_ofstream(std::format("{}/photos/{}.png", m_root, id));
-                curl c;
-                c.perform(url, ofstream);
-                count++;
-                _show_count("photos", count, total, show_progress);
+                std::lock_guard lock(m_download_mutex);
+                if (m_download_error)
+                {
+                    std::rethrow_exception(m_download_error);
+                }
             }
 
-            count = 0;
-            total = m_video_images.size();
-            _show_downloading("video images", show_progress);
-            _create_directory(m_root, "video_images");
-            for (const auto& [id, url] : m_video_images)
-            {
-                std::ofstream ofstream = _open_ofstream(
-                    std::format("{}/video_images/{}.png", m_root, id));
-                curl c;
-                c.perform(url, ofstream);
-                count++;
-                _show_count("video images", count, total, show_progress);
-            }
+            store_completed();
+        }
 
-            count = 0;
-            total = m_documents.size();
-            _show_downloading("documents", show_progress);
-            _create_directory(m_root, "documents");
-            for (const auto& [id, url] : m_documents)
-            {
-                std::ofstream ofstream = _open_ofstream(
-                    std::format("{}/documents/{}.{}", m_root, id, url.ext));
-                curl c;
-                c.perform(url.url, ofstream);
-                count++;
-                _show_count("documents", count, total, show_progress);
-            }
+        pull_links(message);
+        m_db.put(std::move(message));
+    }
 
-            count = 0;
-            total = m_product_thumbs.size();
-            _show_downloading("product thumbs", show_progress);
-            _create_directory(m_root, "product_thumbs");
-            for (const auto& [id, url] : m_product_thumbs)
-            {
-                std::ofstream ofstream = _open_ofstream(
-                    std::format("{}/product_thumbs/{}.png", m_root, id));
-                curl c;
-                c.perform(url, ofstream);
-                count++;
-                _show_count("product thumbs", count, total, show_progress);
-            }
+    void storage::download_media(bool show_progress)
+    {
+        _show_downloading("media", show_progress);
 
-            count = 0;
-            total = m_stickers.size();
-            _show_downloading("stickers", show_progress);
-            _create_directory(m_root, "stickers");
-            for (const auto& [id, url] : m_stickers)
-            {
-                std::ofstream ofstream = _open_ofstream(
-                    std::format("{}/stickers/{}.png", m_root, id));
-                curl c;
-                c.perform(url, ofstream);
-                count++;
-                _show_count("stickers", count, total, show_progress);
-            }
+        if (m_stream_media)
+        {
+            std::unique_lock lock(m_download_mutex);
+            m_download_closed = true;
+            m_download_cv.notify_all();
 
-            count = 0;
-            total = m_gifts.size();
-            _show_downloading("gifts", show_progress);
-            _create_directory(m_root, "gifts");
-            for (const auto& [id, url] : m_gifts)
+            std::size_t shown = 0;
+            while (true)
             {
-                std::ofstream ofstream =
-                    _open_ofstream(std::format("{}/gifts/{}.png", m_root, id));
-                curl c;
-                c.perform(url, ofstream);
-                count++;
-                _show_count("gifts", count, total, show_progress);
-            }
+                if (m_downloaded != shown)
+                {
+                    shown = m_downloaded;
+                    _show_count(
+                        "media files", shown, m_enqueued, show_progress);
+                }
 
-            count = 0;
-            total = m_audio_messages.size();
-            _show_downloading("audio messages", show_progress);
-            _create_directory(m_root, "audio_messages");
-            for (const auto& [id, url] : m_audio_messages)
-            {
-                std::ofstream ofstream = _open_ofstream(
-                    std::format("{}/audio_messages/{}.mp3", m_root, id));
-                curl c;
-                c.perform(url, ofstream);
-                count++;
-                _show_count("audio messages", count, total, show_progress);
+                if (m_download_finished)
+                {
+                    break;
+                }
+
+                m_download_cv.wait(lock);
             }
 
-            count = 0;
-            total = m_graffitis.size();
-            _show_downloading("graffitis", show_progress);
-            _create_directory(m_root, "graffitis");
-            for (const auto& [id, url] : m_graffitis)
+            lock.unlock();
+            m_download_thread.join();
+
+            store_completed();
+            m_db.commit();
+
+            if (m_download_error)
             {
-                std::ofstream ofstream = _open_ofstream(
-                    std::format("{}/graffitis/{}.png", m_root, id));
-                curl c;
-                c.perform(url, ofstream);
-                count++;
-                _show_count("graffitis", count, total, show_progress);
+                std::rethrow_exception(m_download_error);
             }
         }
-        catch (const std::ios::failure&)
-        {
-            throw storage_io_error("IO error");
-        }
+
+        // Media left over by the streaming worker, or by an interrupted run.
+
+        download_queued(show_progress);
     }
 
     void storage::pull_links(const api::vk_data::message& message)
     {
         for (const auto& attachment : message.attachments)
         {
-            switch (attachment.type)
+            switch (attachment.type())
             {
                 using enum api::vk_data::attachment_type;
             case photo:
-                m_photos[attachment.photo_value.id] =
-                    attachment.photo_value.url;
+            {
+                const auto& value =
+                    std::get<api::vk_data::photo>(attachment.value);
+                queue_download(value.url,
+                    std::format("photos/{}.png", value.id));
                 break;
+            }
             case video:
-                if (attachment.video_value.image_url.has_value())
+            {
+                const auto& value =
+                    std::get<api::vk_data::video>(attachment.value);
+                if (value.image_url.has_value())
                 {
-                    m_video_images[attachment.video_value.id] =
-                        attachment.video_value.image_url.value();
+                    queue_download(value.image_url.value(),
+                        std::format("video_images/{}.png", value.id));
                 }
                 break;
+            }
             case document:
-                m_documents[attachment.document_value.id] =
-                    document_url(attachment.document_value.url,
-                        attachment.document_value.ext);
+            {
+                const auto& value =
+                    std::get<api::vk_data::document>(attachment.value);
+                queue_download(value.url,
+                    std::format("documents/{}.{}", value.id, value.ext));
                 break;
+            }
             case product:
-                m_product_thumbs[attachment.product_value.id] =
-                    attachment.product_value.thumb_url;
+            {
+                const auto& value =
+                    std::get<api::vk_data::product>(attachment.value);
+                queue_download(value.thumb_url,
+                    std::format("product_thumbs/{}.png", value.id));
                 break;
+            }
             case sticker:
-                m_stickers[attachment.sticker_value.id] =
-                    attachment.sticker_value.url;
+            {
+                const auto& value =
+                    std::get<api::vk_data::sticker>(attachment.value);
+                queue_download(value.url,
+                    std::format("stickers/{}.png", value.id));
                 break;
+            }
             case gift:
-                m_gifts[attachment.gift_value.id] = attachment.gift_value.url;
+            {
+                const auto& value =
+                    std::get<api::vk_data::gift>(attachment.value);
+                queue_download(value.url,
+                    std::format("gifts/{}.png", value.id));
                 break;
+            }
             case audio_message:
-                m_audio_messages[attachment.audio_message_value.id] =
-                    attachment.audio_message_value.link_mp3;
+            {
+                const auto& value =
+                    std::get<api::vk_data::audio_message>(attachment.value);
+                queue_download(value.link_mp3,
+                    std::format("audio_messages/{}.mp3", value.id));
                 break;
+            }
             case graffiti:
-                m_graffitis[attachment.graffiti_value.id] =
-                    attachment.graffiti_value.url;
+            {
+                const auto& value =
+                    std::get<api::vk_data::graffiti>(attachment.value);
+                queue_download(value.url,
+                    std::format("graffitis/{}.png", value.id));
                 break;
+            }
             default:
                 break;
             }
@@ -252,8 +243,216 @@ namespace vme::db
 
         for (const auto& fwd_message : message.fwd_messages)
         {
-            pull_links(*fwd_message.get());
+            pull_links(fwd_message);
+        }
+    }
+
+    void storage::queue_download(
+        std::string_view url, const std::string& name)
+    {
+        if (m_skip_existing &&
+            std::filesystem::exists(std::format("{}/{}", m_root, name)))
+        {
+            return;
+        }
+
+        if (!m_db.put_media(name, url) || !m_stream_media)
+        {
+            return;
         }
+
+        // A full backlog leaves the media queued in the database; it is
+        // downloaded once paging is over.
+        {
+            std::lock_guard lock(m_download_mutex);
+            if (m_download_queue.size() >= MEDIA_BATCH_SIZE)
+            {
+                return;
+            }
+
+            m_download_queue.emplace_back(
+                url, std::format("{}/{}", m_root, name));
+            m_enqueued++;
+        }
+
+        m_download_cv.notify_all();
+    }
+
+    void storage::download_queued(bool show_progress)
+    {
+        create_directories();
+
+        // Media the streaming worker failed on is not tried again until the
+        // next run.
+        std::size_t total = m_db.queued_media_count() - m_failed.size();
+        std::size_t count = 0;
+        std::string last_name;
+        bool exhausted = false;
+
+        while (true)
+        {
+            if (!exhausted && m_multi.size() < m_max_downloads)
+            {
+                std::vector<std::pair<std::string, std::string>> media =
+                    m_db.queued_media(last_name, MEDIA_BATCH_SIZE);
+                exhausted = media.size() < MEDIA_BATCH_SIZE;
+                if (!media.empty())
+                {
+                    last_name = media.back().first;
+                }
+
+                for (const auto& [name, url] : media)
+                {
+                    std::string path = std::format("{}/{}", m_root, name);
+                    if (!m_failed.contains(path))
+                    {
+                        m_multi.add(url, path);
+                    }
+                }
+            }
+
+            if (exhausted && m_multi.done())
+            {
+                break;
+            }
+
+            std::vector<std::string> completed =
+                downloaded(m_multi.perform(1000));
+            if (completed.empty())
+            {
+                continue;
+            }
+
+            for (const auto& path : completed)
+            {
+                m_db.set_media_done(path.substr(m_root.size() + 1));
+            }
+
+            if (m_db.commit_due())
+            {
+                m_db.commit();
+            }
+
+            count += completed.size();
+            _show_count("media files", count, total, show_progress);
+        }
+
+        m_db.commit();
+    }
+
+    // Media that failed for good is reported and stays queued in the
+    // database, so an incremental run tries it again.
+    std::vector<std::string> storage::downloaded(
+        std::vector<curl_multi::result>&& results)
+    {
+        std::vector<std::string> completed;
+        for (auto& result : results)
+        {
+            if (result.error.empty())
+            {
+                completed.push_back(std::move(result.path));
+                continue;
+            }
+
+            std::cerr << result.error << std::endl;
+
+            std::lock_guard lock(m_download_mutex);
+            m_failed.insert(std::move(result.path));
+        }
+
+        return completed;
+    }
+
+    void storage::store_completed()
+    {
+        std::vector<std::string> completed;
+        {
+            std::lock_guard lock(m_download_mutex);
+            completed.swap(m_completed);
+        }
+
+        for (const auto& path : completed)
+        {
+            m_db.set_media_done(path.substr(m_root.size() + 1));
+        }
+    }
+
+    void storage::create_directories() const
+    {
+        _create_directory(m_root, "photos");
+        _create_directory(m_root, "video_images");
+        _create_directory(m_root, "documents");
+        _create_directory(m_root, "product_thumbs");
+        _create_directory(m_root, "stickers");
+        _create_directory(m_root, "gifts");
+        _create_directory(m_root, "audio_messages");
+        _create_directory(m_root, "graffitis");
+    }
+
+    void storage::download_worker() noexcept
+    {
+        std::exception_ptr error;
+
+        try
+        {
+            while (true)
+            {
+                {
+                    std::unique_lock lock(m_download_mutex);
+                    if (m_multi.done())
+                    {
+                        m_download_cv.wait(lock,
+                            [this]
+                            {
+                                return !m_download_queue.empty() ||
+                                       m_download_closed;
+                            });
+                    }
+
+                    if (m_download_aborted ||
+                        (m_download_closed && m_download_queue.empty() &&
+                            m_multi.done()))
+                    {
+                        break;
+                    }
+
+                    while (!m_download_queue.empty() &&
+                           m_multi.size() < 2 * m_max_downloads)
+                    {
+                        auto& [url, path] = m_download_queue.front();
+                        m_multi.add(url, path);
+                        m_download_queue.pop_front();
+                    }
+                }
+
+                std::vector<std::string> completed =
+                    downloaded(m_multi.perform(100));
+                if (!completed.empty())
+                {
+                    {
+                        std::lock_guard lock(m_download_mutex);
+                        m_downloaded += completed.size();
+                        m_completed.insert(m_completed.end(),
+                            std::make_move_iterator(completed.begin()),
+                            std::make_move_iterator(completed.end()));
+                    }
+
+                    m_download_cv.notify_all();
+                }
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        {
+            std::lock_guard lock(m_download_mutex);
+            m_download_error = error;
+            m_download_finished = true;
+        }
+
+        m_download_cv.notify_all();
     }
 
 }
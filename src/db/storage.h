@@ -1,9 +1,18 @@
 #pragma once
 
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
 
 #include "error.h"
+#include "curl.h"
 #include "db.h"
 #include "api/vk_data.h"
 
@@ -22,39 +31,63 @@ namespace vme::db
     class storage
     {
     public:
-        storage(const std::string& root, db& database);
+        static constexpr std::size_t MEDIA_BATCH_SIZE = 256;
 
-        void put(const api::vk_data::message& message);
+        storage(const std::string& root, db& database,
+            std::size_t max_downloads, std::size_t host_downloads,
+            bool stream_media, bool skip_existing);
 
-        void download_media(bool show_progress) const;
+        storage(const storage& other) = delete;
 
-    private:
-        struct document_url
-        {
-            document_url() { }
+        storage& operator=(const storage& other) = delete;
+
+        ~storage() noexcept;
 
-            document_url(const std::string& url, const std::string& ext) :
-                url(url),
-                ext(ext)
-            {
-            }
+        void put(api::vk_data::message&& message);
 
-            std::string url;
-            std::string ext;
-        };
+        void download_media(bool show_progress);
 
+    private:
         void pull_links(const api::vk_data::message& message);
 
+        void queue_download(std::string_view url, const std::string& name);
+
+        void download_queued(bool show_progress);
+
+        std::vector<std::string> downloaded(
+            std::vector<curl_multi::result>&& results);
+
+        void store_completed();
+
+        void create_directories() const;
+
+        void download_worker() noexcept;
+
         std::string m_root;
         db& m_db;
-        std::unordered_map<std::int64_t, std::string> m_photos;
-        std::unordered_map<std::int64_t, std::string> m_video_images;
-        std::unordered_map<std::int64_t, document_url> m_documents;
-        std::unordered_map<std::int64_t, std::string> m_product_thumbs;
-        std::unordered_map<std::int64_t, std::string> m_stickers;
-        std::unordered_map<std::int64_t, std::string> m_gifts;
-        std::unordered_map<std::int64_t, std::string> m_audio_messages;
-        std::unordered_map<std::int64_t, std::string> m_graffitis;
+        std::size_t m_max_downloads;
+        bool m_stream_media;
+        bool m_skip_existing;
+
+        // Used by the streaming worker, then by the final download pass, so
+        // connections to media hosts stay open between the two.
+        curl_multi m_multi;
+
+        // Media is tracked in the database's media queue, keyed by its path
+        // relative to the storage root. Only a bounded backlog of it is
+        // handed to the streaming download worker.
+        std::mutex m_download_mutex;
+        std::condition_variable m_download_cv;
+        std::deque<std::pair<std::string, std::string>> m_download_queue;
+        std::vector<std::string> m_completed;
+        std::unordered_set<std::string> m_failed;
+        std::size_t m_enqueued;
+        std::size_t m_downloaded;
+        bool m_download_closed;
+        bool m_download_aborted;
+        bool m_download_finished;
+        std::exception_ptr m_download_error;
+        std::thread m_download_thread;
     };
 
 }
@@ -4,6 +4,9 @@
 #include <exception>
 #include <format>
 #include <filesystem>
+#include <chrono>
+#include <algorithm>
+#include <utility>
 
 #include "error.h"
 #include "args.h"
@@ -43,12 +46,32 @@ int main(int argc, char** argv)
                     args.storage_root(), e.what()));
         }
 
-        vme::api::session session("api.vk.com");
-        vme::api::message_stream message_stream(
-            session, args.peer_id(), args.access_token());
-        vme::api::user_pool user_pool(session, args.access_token());
-        vme::db::db db(std::format("{}/database.db", args.storage_root()));
-        vme::db::storage storage(args.storage_root(), db);
+        vme::db::db db(std::format("{}/database.db", args.storage_root()),
+            args.transaction_size(),
+            std::chrono::milliseconds(args.transaction_interval()),
+            args.incremental(), args.write_queue());
+        vme::db::sync_state state = db.load_sync_state(args.peer_id());
+
+        // Messages deleted since the last run shift the offsets back, so
+        // paging starts a page before the checkpoint; message_stream steps
+        // back further when more was deleted.
+        std::size_t offset = state.offset -
+                             std::min(state.offset,
+                                 vme::api::message_stream::PAGE_SIZE);
+
+        vme::api::session session("api.vk.com", args.rate_limit());
+        vme::api::message_stream message_stream(session, args.peer_id(),
+            args.access_token(), args.history_batch(), args.read_ahead(),
+            args.parallel_fetch(), args.parse_threads(), offset,
+            state.last_conversation_message_id, state.next_link_id,
+            state.next_call_id);
+        vme::api::user_pool user_pool(
+            session, args.access_token(), args.defer_users());
+        user_pool.add_known(db.user_ids());
+        user_pool.add_pending(db.pending_users());
+        vme::db::storage storage(args.storage_root(), db,
+            args.max_downloads(), args.host_downloads(), args.stream_media(),
+            args.incremental());
 
         std::cout << std::fixed << std::setprecision(2);
 
@@ -61,8 +84,19 @@ int main(int argc, char** argv)
                 break;
             }
 
-            storage.put(message.value());
+            state.last_conversation_message_id =
+                message->conversation_message_id;
+
             user_pool.pull_users(message.value());
+            storage.put(std::move(message.value()));
+
+            if (db.commit_due())
+            {
+                db.put(user_pool);
+                user_pool.clear();
+                db.save_sync_state(args.peer_id(), message_stream.offset(),
+                    state.last_conversation_message_id);
+            }
 
             if (args.show_progress())
             {
@@ -75,8 +109,20 @@ int main(int argc, char** argv)
             }
         }
 
+        user_pool.resolve();
         db.put(user_pool);
+        db.save_sync_state(args.peer_id(), message_stream.offset(),
+            state.last_conversation_message_id);
         storage.download_media(args.show_progress());
+        db.flush();
+
+        if (args.show_progress())
+        {
+            std::cout << "Received " << session.received_bytes() / 1024
+                      << " KiB of API responses ("
+                      << session.response_bytes() / 1024
+                      << " KiB uncompressed)" << std::endl;
+        }
     }
     catch (const vme::error& e)
     {
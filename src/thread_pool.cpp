@@ -0,0 +1,58 @@
+#include "thread_pool.h"
+
+namespace vme
+{
+
+    thread_pool::thread_pool(std::size_t threads) :
+        m_stopped(false)
+    {
+        for (std::size_t i = 0; i < threads; i++)
+        {
+            m_threads.emplace_back(&thread_pool::worker, this);
+        }
+    }
+
+    thread_pool::~thread_pool() noexcept
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stopped = true;
+        }
+
+        m_cv.notify_all();
+
+        for (auto& thread : m_threads)
+        {
+            thread.join();
+        }
+    }
+
+    std::size_t thread_pool::size() const noexcept { return m_threads.size(); }
+
+    void thread_pool::worker() noexcept
+    {
+        while (true)
+        {
+            std::function<void()> task;
+
+            {
+                std::unique_lock lock(m_mutex);
+                m_cv.wait(
+                    lock, [this] { return m_stopped || !m_tasks.empty(); });
+
+                // Pending tasks are still run, their futures are waited on.
+                if (m_tasks.empty())
+                {
+                    return;
+                }
+
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+
+            // Exceptions are stored in the future of the task.
+            task();
+        }
+    }
+
+}
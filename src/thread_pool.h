@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <future>
+#include <functional>
+#include <type_traits>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace vme
+{
+
+    class thread_pool
+    {
+    public:
+        thread_pool(std::size_t threads);
+
+        thread_pool(const thread_pool& other) = delete;
+
+        thread_pool& operator=(const thread_pool& other) = delete;
+
+        ~thread_pool() noexcept;
+
+        template<class Func>
+        std::future<std::invoke_result_t<Func>> submit(Func func)
+        {
+            auto task = std::make_shared<
+                std::packaged_task<std::invoke_result_t<Func>()>>(
+                std::move(func));
+            auto result = task->get_future();
+
+            {
+                std::lock_guard lock(m_mutex);
+                m_tasks.emplace_back([task] { (*task)(); });
+            }
+
+            m_cv.notify_one();
+            return result;
+        }
+
+        std::size_t size() const noexcept;
+
+    private:
+        void worker() noexcept;
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::deque<std::function<void()>> m_tasks;
+        bool m_stopped;
+        std::vector<std::thread> m_threads;
+    };
+
+}